@@ -1,5 +1,6 @@
 #include "apu.h"
 
+#include <algorithm>
 #include <iostream>
 #include "def.h"
 #include "fmt/format.h"
@@ -14,12 +15,14 @@ const int sequences[4][8] = {
 };
 
 APU::APU(GameBoy* gb) : gb(gb) {
+    updated_at = 0;
     volume = 0.05;
     
     wave_pattern.resize(16);
 
     sample_timer = 0;
     sample_queue_index = 0;
+    sample_queue_count = 0;
     sample_queue.resize(APU_BUFFER_SIZE);
 
     global_timer = 0;
@@ -58,6 +61,12 @@ APU::APU(GameBoy* gb) : gb(gb) {
     ch4_timer = 0;
     ch4_period = 0;
     ch4_lfsr = 0b111111111111111; // 15 bits, initially all are 1
+
+    NR10 = NR11 = NR12 = NR13 = NR14 = 0;
+    NR21 = NR22 = NR23 = NR24 = 0;
+    NR30 = NR31 = NR32 = NR33 = NR34 = 0;
+    NR41 = NR42 = NR43 = NR44 = 0;
+    NR50 = NR51 = NR52 = 0;
 }
 
 APU::~APU() {
@@ -65,6 +74,8 @@ APU::~APU() {
 }
 
 u8 APU::read_byte(u16 address) {
+    update();
+
     u8 result = 0;
 
     switch (address & 0xFF) {
@@ -140,6 +151,8 @@ u8 APU::read_byte(u16 address) {
 }
 
 void APU::write_byte(u16 address, u8 value) {
+    update();
+
     switch (address & 0xFF) {
         case 0x10: {// Channel 1 sweep
             NR10 = value;
@@ -322,6 +335,30 @@ void APU::update_frequencies() {
     //std::cout << "Ch3 frequency: " << ch3_frequency << std::endl;
 }
 
+// Advances a channel timer by a number of cycles. Every cycle the timer is
+// restarted if it equals the period, and then incremented. Returns the number
+// of restarts. A timer above its period only comes back around when the int
+// wraps, like it does when stepping cycle by cycle.
+static int run_timer(int& timer, int period, int cycles) {
+    unsigned int first = (unsigned int)(period - timer);
+    if ((unsigned int)cycles <= first) {
+        timer = (int)((unsigned int)timer + cycles);
+        return 0;
+    }
+
+    // The cycles after the first restart, which leaves the timer at 1
+    int left = cycles - 1 - first;
+    if (period <= 0) {
+        timer = 1 + left;
+        return 1;
+    }
+
+    timer = 1 + left % period;
+    return 1 + left / period;
+}
+
+// Runs a single cycle. This is the reference for run(), which gives the same
+// result for many cycles at once.
 void APU::cycle() {
     // Happens every 1/8th of the square wave period
     if (ch1_timer == (CLOCK_FREQ / (8 * ch1_frequency))) {
@@ -354,21 +391,7 @@ void APU::cycle() {
     ch3_timer++;
 
     if (ch4_timer == ch4_period) {
-        // XOR two lowest bits of the LFSR
-        bool result = (ch4_lfsr & 0b01) ^ ((ch4_lfsr & 0b10) >> 1);
-
-        ch4_lfsr = ch4_lfsr >> 1;
-        SET_BIT(ch4_lfsr, 14, result);
-
-        // Also set bit 6 of the LFSR
-        if (GET_BIT(NR43, 3)) {
-            SET_BIT(ch4_lfsr, 6, result);
-            std::cout << "7-bit mode" << std::endl;
-        }
-            
-
-        //std::cout << fmt::format("Updated the LFSR: {:015b}, xor={}", ch4_lfsr, result) << std::endl;
-
+        step_lfsr();
         ch4_timer = 0;
     }
     ch4_timer++;
@@ -384,12 +407,96 @@ void APU::cycle() {
         
         if (sequencer_step == 8)
             sequencer_step = 0;
+
+        step_sequencer();
     } else{
         sequencer_updated = false;
     }
 
+    check_lengths();
+
+    // Once every 87 CPU cycles, put an audio sample in the queue
+    if (sample_timer == DOWNSAMPLE_RATE) {
+        sample_timer = 0;
+        output_sample();
+    }
+
+    sample_timer++;
+
+    global_timer++;
+}
+
+/*
+    Runs many cycles at once. Between frame sequencer steps and samples the
+    channels only count towards their next waveform step, so the cycles are
+    split into segments that end at a step or a sample, and the channel
+    timers are advanced by a whole segment at a time.
+*/
+void APU::run(int cycles) {
+    while (cycles > 0) {
+        // Segments end in the cycle of a sequencer step or a sample
+        int sequencer_cycles = 8192 - sequencer_clock;
+        int sample_cycles = DOWNSAMPLE_RATE - sample_timer + 1;
+        int length = std::min(cycles, std::min(sequencer_cycles, sample_cycles));
+
+        int steps = run_timer(ch1_timer, CLOCK_FREQ / (8 * ch1_frequency), length);
+        ch1_sequence_index = (ch1_sequence_index + steps) % 8;
+
+        steps = run_timer(ch2_timer, CLOCK_FREQ / (8 * ch2_frequency), length);
+        ch2_sequence_index = (ch2_sequence_index + steps) % 8;
+
+        steps = run_timer(ch3_timer, CLOCK_FREQ / (8 * ch3_frequency), length);
+        ch3_sequence_index = (ch3_sequence_index + steps) % 32;
+
+        steps = run_timer(ch4_timer, ch4_period, length);
+        for (int i = 0; i < steps; i++)
+            step_lfsr();
+
+        sequencer_clock += length;
+        sequencer_updated = sequencer_clock == 8192;
+        if (sequencer_updated) {
+            sequencer_clock = 0;
+            sequencer_step = (sequencer_step + 1) % 8;
+            step_sequencer();
+        }
+
+        // The length counters only change in a sequencer step and when the
+        // registers are written, which happens before the first segment
+        check_lengths();
+
+        sample_timer += length - 1;
+        if (sample_timer == DOWNSAMPLE_RATE) {
+            sample_timer = 0;
+            output_sample();
+        }
+        sample_timer++;
+
+        global_timer += length;
+        cycles -= length;
+    }
+}
+
+void APU::step_lfsr() {
+    // XOR two lowest bits of the LFSR
+    bool result = (ch4_lfsr & 0b01) ^ ((ch4_lfsr & 0b10) >> 1);
+
+    ch4_lfsr = ch4_lfsr >> 1;
+    SET_BIT(ch4_lfsr, 14, result);
+
+    // Also set bit 6 of the LFSR
+    if (GET_BIT(NR43, 3)) {
+        SET_BIT(ch4_lfsr, 6, result);
+        std::cout << "7-bit mode" << std::endl;
+    }
+        
+
+    //std::cout << fmt::format("Updated the LFSR: {:015b}, xor={}", ch4_lfsr, result) << std::endl;
+}
+
+// Clocks the length counters, envelopes and sweep for the new sequencer step
+void APU::step_sequencer() {
     // Decrease length counters every other sequencer step -> 256 Hz
-    if (sequencer_updated && sequencer_step % 2 == 0) {
+    if (sequencer_step % 2 == 0) {
         ch1_length_counter--;
         ch2_length_counter--;
         ch3_length_counter--;
@@ -399,7 +506,7 @@ void APU::cycle() {
     }
 
     // Update envelope every 7th sequencer step -> 64 Hz
-    if (sequencer_updated && sequencer_step == 7) {
+    if (sequencer_step == 7) {
         ch1_envelope_counter--;
         //std::cout << "ch1_envelope_counter=" << ch1_envelope_counter << std::endl;
         if (ch1_envelope_counter == 0) {
@@ -443,7 +550,7 @@ void APU::cycle() {
         }
     }
     // Update sweep every 4th sequencer step -> 128 Hz
-    if (sequencer_updated && (sequencer_step - 2) % 4 == 0) {
+    if ((sequencer_step - 2) % 4 == 0) {
         ch1_sweep_counter--;
         //std::cout << "Sweep counter: " << ch1_sweep_counter << std::endl;
 
@@ -458,7 +565,10 @@ void APU::cycle() {
             ch1_sweep_counter = (NR10 & 0b1110000) >> 4;
         }
     }
+}
 
+// Disables the channels whose length ran out, if they stop at the end of it
+void APU::check_lengths() {
     if (ch1_enabled && ch1_length_counter == 0) {
         if (GET_BIT(NR14, 6)) {
             ch1_enabled = false;
@@ -486,66 +596,83 @@ void APU::cycle() {
             //std::cout << "disabled ch4 due to length" << std::endl;
         }
     }
+}
 
-    // Once every 87 CPU cycles, put an audio sample in the queue
-    if (sample_timer == DOWNSAMPLE_RATE) {
-        sample_timer = 0;
-
-        // Get the current square wave duty cycle pattern
-        int pattern = (NR11 & 0b11000000) >> 6;
-        // Go from (0, 1) pattern to (-15, 15) output value
-        int ch1_output = ((sequences[pattern][ch1_sequence_index] * 2) - 1) * ch1_volume * ch1_enabled;
+// Mixes the channels into the next sample of the queue
+void APU::output_sample() {
+    // Get the current square wave duty cycle pattern
+    int pattern = (NR11 & 0b11000000) >> 6;
+    // Go from (0, 1) pattern to (-15, 15) output value
+    int ch1_output = ((sequences[pattern][ch1_sequence_index] * 2) - 1) * ch1_volume * ch1_enabled;
 
-        pattern = (NR21 & 0b11000000) >> 6;
-        int ch2_output = ((sequences[pattern][ch2_sequence_index] * 2) - 1) * ch2_volume * ch2_enabled;
+    pattern = (NR21 & 0b11000000) >> 6;
+    int ch2_output = ((sequences[pattern][ch2_sequence_index] * 2) - 1) * ch2_volume * ch2_enabled;
 
-        u8 current_byte = gb->mmu.read_byte(0xFF30 + (ch3_sequence_index >> 1));
-        //if (ch3_enabled)
-        //    std::cout << fmt::format("mem={:04X}", ch3_sequence_index >> 1) << std::endl;
-        u8 sample = 0;
-        if (ch3_sequence_index & 0b1)
-            sample = current_byte & 0x0F;
-        else
-            sample = current_byte >> 8;
+    // Not through the MMU, reading a register brings the APU up to date
+    u8 current_byte = wave_pattern[ch3_sequence_index >> 1];
+    //if (ch3_enabled)
+    //    std::cout << fmt::format("mem={:04X}", ch3_sequence_index >> 1) << std::endl;
+    u8 sample = 0;
+    if (ch3_sequence_index & 0b1)
+        sample = current_byte & 0x0F;
+    else
+        sample = current_byte >> 8;
 
-        u8 output_level = NR32 & 0b1100000;
+    u8 output_level = NR32 & 0b1100000;
 
-        int ch3_output = (sample) * ch3_enabled;
+    int ch3_output = (sample) * ch3_enabled;
 
-        if (output_level == 0)
-            ch3_output = 0;
+    if (output_level == 0)
+        ch3_output = 0;
 
-        int ch4_output = (GET_BIT(ch4_lfsr, 0) * 2 - 1) * ch4_volume * ch4_enabled;
+    int ch4_output = (GET_BIT(ch4_lfsr, 0) * 2 - 1) * ch4_volume * ch4_enabled;
 
-        // Convert channel outputs to (-1.0, 1.0) range and sum
-        float mixed = (float)ch1_output / 15.0f + (float)ch2_output / 15.0f + (float)ch3_output / 15.0F + (float)ch4_output / 15.0f;
-        //float mixed = (float)ch4_output / 15.0f;
+    // Convert channel outputs to (-1.0, 1.0) range and sum
+    float mixed = (float)ch1_output / 15.0f + (float)ch2_output / 15.0f + (float)ch3_output / 15.0F + (float)ch4_output / 15.0f;
+    //float mixed = (float)ch4_output / 15.0f;
 
-        // Clip because summing can go above 1.0
-        if (mixed < -1.0f) {
-            //std::cout << "clipped - " << ch4_output << " " << mixed << " " << GET_BIT(ch4_lfsr, 0) << std::endl;
-            mixed = -1.0f;
-        }
-            
-        if (mixed > 1.0f) {
-            //std::cout << "clipped + " << ch4_output << " " << mixed << std::endl;
-            mixed = 1.0f;
-        }
-            
+    // Clip because summing can go above 1.0
+    if (mixed < -1.0f) {
+        //std::cout << "clipped - " << ch4_output << " " << mixed << " " << GET_BIT(ch4_lfsr, 0) << std::endl;
+        mixed = -1.0f;
+    }
+        
+    if (mixed > 1.0f) {
+        //std::cout << "clipped + " << ch4_output << " " << mixed << std::endl;
+        mixed = 1.0f;
+    }
+        
 
-        // Global volume control
-        mixed *= volume;
+    // Global volume control
+    mixed *= volume;
 
-        sample_queue[sample_queue_index] = mixed;
-        sample_queue_index++;
+    sample_queue[sample_queue_index] = mixed;
+    sample_queue_index++;
 
-        // The queue is full, go to the beginning again
-        // At this point the queue can be sent for playback
-        if (sample_queue_index == APU_BUFFER_SIZE)
-            sample_queue_index = 0;
+    // The queue is full, go to the beginning again
+    // At this point the queue can be sent for playback
+    if (sample_queue_index == APU_BUFFER_SIZE) {
+        sample_queue_index = 0;
+        sample_queue_count++;
     }
+}
 
-    sample_timer++;
+// Runs the APU for the cycles since it was last updated. Nothing else can
+// see its state, so this only happens when its registers are accessed and
+// when the sample queue is full.
+void APU::update() {
+    // The APU runs at 4 MHz
+    run(gb->cpu.cycles - updated_at);
 
-    global_timer++;
-}
\ No newline at end of file
+    updated_at = gb->cpu.cycles;
+    gb->scheduler.schedule(Event::APU, updated_at + cycles_until_event());
+}
+
+// The number of cycles until the sample queue is full
+int APU::cycles_until_event() {
+    // The next sample is taken in the cycle where sample_timer reaches
+    // DOWNSAMPLE_RATE, and after that every DOWNSAMPLE_RATE cycles
+    int samples_left = APU_BUFFER_SIZE - sample_queue_index;
+
+    return (DOWNSAMPLE_RATE - sample_timer + 1) + (samples_left - 1) * DOWNSAMPLE_RATE;
+}
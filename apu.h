@@ -61,14 +61,24 @@ public:
     void update_frequencies();
 
     void cycle();
+    void run(int cycles);
+    void step_lfsr();
+    void step_sequencer();
+    void check_lengths();
+    void output_sample();
+
+    void update();
+    int cycles_until_event();
 
 public:
     GameBoy* gb;
 
+    unsigned int updated_at; // CPU cycle the APU was last updated
     float volume;
 
     int sample_timer;
     int sample_queue_index;
+    unsigned int sample_queue_count; // Times the queue was filled
     std::vector<float> sample_queue;
 
     int global_timer;
@@ -0,0 +1,127 @@
+// APU benchmark: the time it takes to synthesize an emulated second of audio
+//
+// All four channels play notes that change every frame, like the music of a
+// game. Only the APU is run, once cycle by cycle like GameBoy::cycle used to
+// do and once in batches between register writes like it does now. The
+// samples of both are compared as well.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "bench.h"
+#include "gameboy.h"
+
+const char* ROM_FILENAME = "apu_bench.gb";
+const int EMULATED_SECONDS = 10;
+const int REPEATS = 3;
+
+// Every frame one of the channels starts a new note, the others change pitch
+void play_notes(APU& apu, int frame) {
+    int x = 1024 + (frame * 37) % 900;
+
+    apu.write_byte(0xFF13, x & 0xFF);
+    apu.write_byte(0xFF18, (x / 2) & 0xFF);
+    apu.write_byte(0xFF1D, (x / 3) & 0xFF);
+
+    switch (frame % 4) {
+    case 0:
+        apu.write_byte(0xFF11, 0x80); // 50% duty
+        apu.write_byte(0xFF12, 0xF3); // Decreasing envelope
+        apu.write_byte(0xFF14, 0x80 | (x >> 8));
+        break;
+    case 1:
+        apu.write_byte(0xFF16, 0x40); // 25% duty
+        apu.write_byte(0xFF17, 0xA2);
+        apu.write_byte(0xFF19, 0x80 | (x >> 8));
+        break;
+    case 2:
+        apu.write_byte(0xFF1A, 0x80);
+        apu.write_byte(0xFF1C, 0x20);
+        apu.write_byte(0xFF1E, 0x80 | 0x06);
+        break;
+    case 3:
+        apu.write_byte(0xFF21, 0xF1);
+        apu.write_byte(0xFF22, 0x04 | (frame & 0x03));
+        apu.write_byte(0xFF23, 0x80);
+        break;
+    }
+}
+
+// Runs the APU up to the given CPU cycle
+void run_until(GameBoy* gb, unsigned int cycles, bool batched) {
+    if (batched) {
+        gb->cpu.cycles = cycles;
+        gb->apu.update();
+    } else {
+        for (unsigned int i = gb->apu.updated_at; i < cycles; i++)
+            gb->apu.cycle();
+
+        gb->cpu.cycles = cycles;
+        gb->apu.updated_at = cycles;
+    }
+}
+
+// Returns the time per emulated second in milliseconds
+double run(bool batched) {
+    GameBoy* gb = new GameBoy(ROM_FILENAME);
+    int frames = EMULATED_SECONDS * CLOCK_FREQ / T_FULL_FRAME;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        play_notes(gb->apu, frame);
+        run_until(gb, (frame + 1) * T_FULL_FRAME, batched);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    delete gb;
+
+    return std::chrono::duration<double, std::milli>(end - start).count() / EMULATED_SECONDS;
+}
+
+// Whether both ways of running give the same samples. A sample stays in the
+// queue for longer than a frame, so comparing the queues every frame covers
+// all of them.
+bool same_samples() {
+    GameBoy* cycled = new GameBoy(ROM_FILENAME);
+    GameBoy* batched = new GameBoy(ROM_FILENAME);
+    int frames = EMULATED_SECONDS * CLOCK_FREQ / T_FULL_FRAME;
+
+    bool same = true;
+    for (int frame = 0; frame < frames && same; frame++) {
+        play_notes(cycled->apu, frame);
+        play_notes(batched->apu, frame);
+        run_until(cycled, (frame + 1) * T_FULL_FRAME, false);
+        run_until(batched, (frame + 1) * T_FULL_FRAME, true);
+
+        same = cycled->apu.sample_queue_index == batched->apu.sample_queue_index &&
+               memcmp(&cycled->apu.sample_queue[0], &batched->apu.sample_queue[0],
+                      APU_BUFFER_SIZE * sizeof(float)) == 0;
+    }
+
+    delete cycled;
+    delete batched;
+
+    return same;
+}
+
+int main() {
+    // The CPU is not used
+    write_rom(ROM_FILENAME, {});
+
+    double results[2];
+    for (int batched = 0; batched < 2; batched++)
+        results[batched] = best_of(REPEATS, [&] { return run(batched); });
+
+    bool same = same_samples();
+    remove(ROM_FILENAME);
+
+    printf("\nAPU, %d emulated seconds\n", EMULATED_SECONDS);
+    printf("%-24s %s\n", "Synthesis", "ms/emulated second");
+    printf("%-24s %8.3f\n", "Cycle by cycle", results[0]);
+    printf("%-24s %8.3f\n", "Batched", results[1]);
+    printf("%-24s %8.2fx\n", "Speedup", results[0] / results[1]);
+    printf("%-24s %s\n", "Samples", same ? "identical" : "DIFFERENT");
+
+    return same ? 0 : 1;
+}
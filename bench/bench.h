@@ -0,0 +1,59 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Helpers shared by the benchmarks and checks in this directory
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "def.h"
+
+// Builds a 32 KiB ROM without a memory mapper. The code starts at 0x150,
+// right after a jump over the header, and every handler is placed at its
+// address (0x40 for VBlank, 0x50 for the timer, ...).
+inline void write_rom(const char* filename, const std::vector<u8>& code,
+                      const std::map<u16, std::vector<u8>>& handlers = {}) {
+    std::vector<u8> rom(0x8000, 0);
+
+    for (const auto& handler : handlers)
+        std::copy(handler.second.begin(), handler.second.end(), rom.begin() + handler.first);
+
+    // Jump over the header
+    rom[0x100] = 0xC3; rom[0x101] = 0x50; rom[0x102] = 0x01;
+    std::copy(code.begin(), code.end(), rom.begin() + 0x150);
+
+    FILE* file = fopen(filename, "wb");
+    fwrite(&rom[0], 1, rom.size(), file);
+    fclose(file);
+}
+
+// Runs a measurement repeatedly and keeps the lowest time, to filter out
+// noise
+template <typename Function>
+double best_of(int repeats, Function function) {
+    double best = function();
+    for (int i = 1; i < repeats; i++) {
+        double time = function();
+        if (time < best)
+            best = time;
+    }
+
+    return best;
+}
+
+// The same for measurements of a rate, which keep the highest one
+template <typename Function>
+double best_rate_of(int repeats, Function function) {
+    double best = function();
+    for (int i = 1; i < repeats; i++) {
+        double rate = function();
+        if (rate > best)
+            best = rate;
+    }
+
+    return best;
+}
+
+#endif
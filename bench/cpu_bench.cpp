@@ -0,0 +1,96 @@
+// CPU benchmark: the time per instruction for a selection of opcodes
+//
+// Every case is a short sequence of instructions which is repeated to fill
+// the first ROM bank, followed by a jump back to the start. Only the CPU is
+// run, so the GPU and APU don't hide the cost of the instructions themselves.
+// Build with and without -DCPU_EAGER_FLAGS to compare the flag modes, see
+// the bench target in the Makefile.
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "bench.h"
+#include "gameboy.h"
+
+const char* ROM_FILENAME = "cpu_bench.gb";
+const long INSTRUCTIONS = 20000000;
+const int REPEATS = 3;
+
+struct BenchCase {
+    const char* name;
+    std::vector<u8> code;
+    int instructions;
+};
+
+const BenchCase cases[] = {
+    {"LD B,C", {0x41}, 1},
+    {"ADD A,B", {0x80}, 1},
+    {"ADC A,C", {0x89}, 1},
+    {"SUB D", {0x92}, 1},
+    {"SBC A,E", {0x9B}, 1},
+    {"AND H", {0xA4}, 1},
+    {"XOR A", {0xAF}, 1},
+    {"OR L", {0xB5}, 1},
+    {"CP B", {0xB8}, 1},
+    {"ADD A,d8", {0xC6, 0x12}, 1},
+    {"CP d8", {0xFE, 0x40}, 1},
+    {"INC B", {0x04}, 1},
+    {"DEC C", {0x0D}, 1},
+    {"RLC B", {0xCB, 0x00}, 1},
+    {"SRL A", {0xCB, 0x3F}, 1},
+    {"BIT 7,H", {0xCB, 0x7C}, 1},
+    {"DEC B; JR NZ", {0x05, 0x20, 0x00}, 2},
+    {"CP d8; JR Z", {0xFE, 0x40, 0x28, 0x00}, 2},
+    {"INC A; PUSH AF; POP AF", {0x3C, 0xF5, 0xF1}, 3},
+};
+
+// Repeats the case up to the end of the first ROM bank
+std::vector<u8> program(const BenchCase& bench_case) {
+    std::vector<u8> code;
+    while (0x150 + code.size() + bench_case.code.size() + 3 <= 0x4000)
+        code.insert(code.end(), bench_case.code.begin(), bench_case.code.end());
+
+    // JP 0150
+    code.push_back(0xC3); code.push_back(0x50); code.push_back(0x01);
+
+    return code;
+}
+
+double run(const BenchCase& bench_case) {
+    write_rom(ROM_FILENAME, program(bench_case));
+
+    GameBoy* gb = new GameBoy(ROM_FILENAME);
+    gb->disable_bios = 1;
+    gb->cpu.PC = 0x100;
+    gb->cpu.SP = 0xFFFE;
+
+    // Executing the jumps back to the start is included in the count
+    long steps = INSTRUCTIONS / bench_case.instructions * bench_case.instructions;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < steps; i++)
+        gb->cpu.execute_opcode();
+    auto end = std::chrono::steady_clock::now();
+
+    delete gb;
+    remove(ROM_FILENAME);
+
+    return std::chrono::duration<double, std::nano>(end - start).count() / steps;
+}
+
+int main() {
+    std::vector<double> results;
+    for (const BenchCase& bench_case : cases)
+        results.push_back(best_of(REPEATS, [&] { return run(bench_case); }));
+
+#ifdef CPU_EAGER_FLAGS
+    printf("\nEager flags\n");
+#else
+    printf("\nLazy flags\n");
+#endif
+    printf("%-24s %s\n", "Instructions", "ns/instruction");
+    for (std::size_t i = 0; i < results.size(); i++)
+        printf("%-24s %8.2f\n", cases[i].name, results[i]);
+
+    return 0;
+}
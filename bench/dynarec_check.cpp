@@ -0,0 +1,108 @@
+// Dynarec check: runs the same program with and without the dynarec and
+// compares the results
+//
+// Every case enables the timer interrupt and spins in a loop of INC B, which
+// gets translated. The interrupt handler stores B to WRAM, so the recorded
+// bytes show exactly which instruction every interrupt arrived at.
+#include <cstdio>
+#include <vector>
+
+#include "bench.h"
+#include "gameboy.h"
+
+const char* ROM_FILENAME = "dynarec_check.gb";
+const unsigned int CYCLES = 409600;
+
+// The interrupt handler stores this many bytes at most
+const int RECORDED_BYTES = 0x1000;
+
+struct CheckCase {
+    const char* name;
+    u8 timer_control; // FF07
+    u8 timer_modulo;  // FF06
+    int loop_length;  // INC B instructions before the jump back
+};
+
+const CheckCase cases[] = {
+    {"4096 Hz, full period", 0x04, 0x00, 16},
+    {"262144 Hz, full period", 0x05, 0x00, 16},
+    {"262144 Hz, modulo F0", 0x05, 0xF0, 16},
+    {"65536 Hz, modulo 80", 0x06, 0x80, 40},
+    {"16384 Hz, modulo FF", 0x07, 0xFF, 7},
+};
+
+// Timer interrupt handler: LD (HL),B; INC HL; RETI
+const std::vector<u8> timer_handler = {0x70, 0x23, 0xD9};
+
+std::vector<u8> program(const CheckCase& check_case) {
+    std::vector<u8> code = {
+        0x3E, check_case.timer_modulo,  // LD A,d8
+        0xE0, 0x06,                     // LDH (TMA),A
+        0x3E, check_case.timer_control, // LD A,d8
+        0xE0, 0x07,                     // LDH (TAC),A
+        0x3E, 0x04,                     // LD A,d8
+        0xE0, 0xFF,                     // LDH (IE),A
+        0x21, 0x00, 0xC0,               // LD HL,C000
+        0xFB,                           // EI
+    };
+
+    for (int i = 0; i < check_case.loop_length; i++)
+        code.push_back(0x04); // INC B
+    code.push_back(0x18); // JR back to the first INC B
+    code.push_back(-(check_case.loop_length + 2));
+
+    return code;
+}
+
+std::vector<u8> run(bool dynarec) {
+    GameBoy* gb = new GameBoy(ROM_FILENAME);
+    gb->disable_bios = 1;
+    gb->cpu.PC = 0x100;
+    gb->cpu.SP = 0xFFFE;
+    gb->cpu.dynarec.enabled = dynarec;
+
+    while (gb->cpu.cycles < CYCLES)
+        gb->step();
+
+    std::vector<u8> result;
+    for (int i = 0; i < RECORDED_BYTES; i++)
+        result.push_back(gb->mmu.read_byte(0xC000 + i));
+
+    delete gb;
+
+    return result;
+}
+
+int main() {
+    int failures = 0;
+
+    for (const CheckCase& check_case : cases) {
+        write_rom(ROM_FILENAME, program(check_case), {{0x50, timer_handler}});
+
+        std::vector<u8> interpreted = run(false);
+        std::vector<u8> translated = run(true);
+
+        int differences = 0;
+        int first = -1;
+        for (int i = 0; i < RECORDED_BYTES; i++) {
+            if (interpreted[i] != translated[i]) {
+                if (first < 0)
+                    first = i;
+                differences++;
+            }
+        }
+
+        if (differences == 0) {
+            printf("%-24s ok\n", check_case.name);
+        } else {
+            printf("%-24s %d bytes differ, first at %04X: %02X instead of %02X\n",
+                check_case.name, differences, 0xC000 + first,
+                translated[first], interpreted[first]);
+            failures++;
+        }
+    }
+
+    remove(ROM_FILENAME);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,103 @@
+// Frameskip benchmark: emulated frames per second when only some frames are
+// drawn, like a headless run that only looks at one frame in N
+//
+// A small program with the background and sprites enabled scrolls the
+// background and moves the sprites every frame. It is run drawing every
+// frame and skipping 1, 3 and 7 frames after each drawn one. A ROM file can
+// be given instead of the built-in program.
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "gameboy.h"
+
+const char* ROM_FILENAME = "frameskip_bench.gb";
+const unsigned int EMULATED_SECONDS = 10;
+const int REPEATS = 3;
+const int FRAMESKIPS[] = {0, 1, 3, 7};
+
+const std::vector<u8> program = {
+    0x31, 0xFE, 0xFF,       //       LD SP,FFFE
+    0x21, 0x00, 0x80,       //       LD HL,8000
+    0x01, 0x00, 0x18,       //       LD BC,1800
+    0x79,                   // tile: LD A,C           fill the tiles
+    0x22,                   //       LD (HL+),A
+    0x0B,                   //       DEC BC
+    0x78,                   //       LD A,B
+    0xB1,                   //       OR C
+    0x20, 0xF9,             //       JR NZ,tile
+    0x21, 0x00, 0xFE,       //       LD HL,FE00
+    0x06, 0xA0,             //       LD B,A0
+    0x78,                   // oam:  LD A,B           spread out 40 sprites
+    0x22,                   //       LD (HL+),A
+    0x05,                   //       DEC B
+    0x20, 0xFB,             //       JR NZ,oam
+    0x3E, 0x93, 0xE0, 0x40, //       LD A,93; LDH (40),A  LCD, background and sprites on
+    0x3E, 0xE4, 0xE0, 0x47, //       LD A,E4; LDH (47),A
+    0xE0, 0x48,             //       LDH (48),A
+    0x3E, 0x01, 0xE0, 0xFF, //       LD A,01; LDH (FF),A  VBlank interrupt
+    0xFB,                   //       EI
+    0x76,                   // loop: HALT
+    0x18, 0xFD,             //       JR loop
+};
+
+// Scrolls the background and moves the first sprite every frame
+const std::vector<u8> vblank_handler = {
+    0xF5,                   // PUSH AF
+    0xF0, 0x43, 0x3C,       // LDH A,(43); INC A
+    0xE0, 0x43, 0xE0, 0x42, // LDH (43),A; LDH (42),A
+    0xEA, 0x01, 0xFE,       // LD (FE01),A
+    0xF1, 0xD9,             // POP AF; RETI
+};
+
+// Returns the number of emulated frames per second
+double run(const std::string& filename, int frameskip) {
+    GameBoy* gb = new GameBoy(filename);
+    gb->disable_bios = 1;
+    gb->cpu.PC = 0x100;
+    gb->cpu.SP = 0xFFFE;
+
+    unsigned int end_cycles = EMULATED_SECONDS * CLOCK_FREQ;
+    long frames = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    while (gb->cpu.cycles < end_cycles) {
+        gb->cycle();
+
+        // Decide whether to draw the next frame before it starts
+        if (gb->gpu.redraw) {
+            frames++;
+            gb->render_requested = frames % (frameskip + 1) == 0;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    delete gb;
+
+    return frames / std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string filename = ROM_FILENAME;
+    if (argc > 1)
+        filename = argv[1];
+    else
+        write_rom(ROM_FILENAME, program, {{0x40, vblank_handler}});
+
+    const int count = sizeof(FRAMESKIPS) / sizeof(FRAMESKIPS[0]);
+    double results[count];
+    for (int j = 0; j < count; j++)
+        results[j] = best_rate_of(REPEATS, [&] { return run(filename, FRAMESKIPS[j]); });
+
+    if (argc <= 1)
+        remove(ROM_FILENAME);
+
+    printf("\n%u emulated seconds of %s\n", EMULATED_SECONDS, filename.c_str());
+    printf("%-24s %10s %8s\n", "Frameskip", "frames/s", "speedup");
+    for (int j = 0; j < count; j++)
+        printf("%-24d %10.0f %7.2fx\n", FRAMESKIPS[j], results[j], results[j] / results[0]);
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+// GPU benchmark: the time it takes to render a frame of scanlines
+//
+// VRAM is filled with random tiles and all 40 sprites are placed on the
+// screen, some flipped, behind the background or crossing the right edge.
+// The scroll position, window position, palettes and sprite positions
+// change every frame.
+// Frames are rendered with the pixel by pixel compositor and with the
+// SSSE3 one, and the screens of both are compared as well.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "bench.h"
+#include "gameboy.h"
+
+const char* ROM_FILENAME = "gpu_bench.gb";
+const int FRAMES = 2000;
+const int REPEATS = 3;
+
+GameBoy* create(bool simd) {
+    GameBoy* gb = new GameBoy(ROM_FILENAME);
+    GPU& gpu = gb->gpu;
+    std::mt19937 random(1);
+
+    // Tile data and both tilemaps
+    for (int i = 0; i < VRAM_SIZE; i++)
+        gb->mmu.vram[i] = random() & 0xFF;
+    gpu.dirty_tiles.assign(256 + 128, true);
+
+    for (int i = 0; i < 40 * 4; i++)
+        gpu.update_object(i, random() & 0xFF);
+
+    gpu.simd_compositor = simd;
+    gpu.background_enabled = true;
+    gpu.sprites_enabled = true;
+
+    return gb;
+}
+
+// Moves the background, the window and the sprites, and changes the palettes
+void update(GPU& gpu, int frame) {
+    gpu.scroll_x = frame * 3;
+    gpu.scroll_y = frame;
+    gpu.background_tileset = frame & 1;
+    gpu.background_tilemap = frame & 2;
+    gpu.background_palette = 0xE4 ^ (frame & 0xFF);
+    gpu.sprite_palette_0 = 0xD2 + frame;
+    gpu.sprite_palette_1 = 0x1B ^ frame;
+    gpu.window_enabled = frame & 4;
+    gpu.window_tilemap = frame & 8;
+    gpu.window_x = frame % 176;
+    gpu.window_y = frame % 150;
+
+    for (int i = 0; i < 40; i++) {
+        gpu.update_object(i * 4, 16 + (i * 5 + frame) % 160);
+        gpu.update_object(i * 4 + 1, (i * 11 + frame * 2) % 176);
+    }
+}
+
+void render_frame(GPU& gpu) {
+    gpu.window_line = 0;
+    for (int line = 0; line < PIXELS_H; line++) {
+        gpu.current_line = line;
+        gpu.render_scanline();
+    }
+}
+
+// Returns the time per frame in microseconds
+double run(bool simd) {
+    GameBoy* gb = create(simd);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < FRAMES; frame++) {
+        update(gb->gpu, frame);
+        render_frame(gb->gpu);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    delete gb;
+
+    return std::chrono::duration<double, std::micro>(end - start).count() / FRAMES;
+}
+
+bool same_pixels() {
+    GameBoy* scalar = create(false);
+    GameBoy* simd = create(true);
+
+    bool same = true;
+    for (int frame = 0; frame < FRAMES && same; frame++) {
+        update(scalar->gpu, frame);
+        update(simd->gpu, frame);
+        render_frame(scalar->gpu);
+        render_frame(simd->gpu);
+
+        same = memcmp(&scalar->gpu.screen[0], &simd->gpu.screen[0],
+                      PIXELS_W * PIXELS_H) == 0;
+    }
+
+    delete scalar;
+    delete simd;
+
+    return same;
+}
+
+int main() {
+    // The CPU is not used
+    write_rom(ROM_FILENAME, {});
+
+    double results[2];
+    for (int simd = 0; simd < 2; simd++)
+        results[simd] = best_of(REPEATS, [&] { return run(simd); });
+
+    bool same = same_pixels();
+    remove(ROM_FILENAME);
+
+#if !defined(GPU_SCALAR) && defined(__SSSE3__)
+    const char* instructions = "SSSE3";
+#else
+    const char* instructions = "none";
+#endif
+
+    printf("\nGPU, %d frames, vector instructions: %s\n", FRAMES, instructions);
+    printf("%-24s %s\n", "Compositor", "us/frame");
+    printf("%-24s %8.3f\n", "Pixel by pixel", results[0]);
+    printf("%-24s %8.3f\n", "Vector", results[1]);
+    printf("%-24s %8.2fx\n", "Speedup", results[0] / results[1]);
+    printf("%-24s %s\n", "Pixels", same ? "identical" : "DIFFERENT");
+
+    return same ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// Emulation loop benchmark: instructions per second of the whole system
+//
+// A small program with the LCD, the timer and their interrupts enabled copies
+// a block of memory around forever. It is run once with the scheduler, which
+// only updates the other components when they reach their deadline, and once
+// with every component polled after every instruction like GameBoy::cycle
+// used to do. A ROM file can be given instead of the built-in program.
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "gameboy.h"
+
+const char* ROM_FILENAME = "ips_bench.gb";
+const unsigned int EMULATED_SECONDS = 10;
+const int REPEATS = 3;
+
+const std::vector<u8> program = {
+    0x31, 0xFE, 0xFF,       //       LD SP,FFFE
+    0x3E, 0x91, 0xE0, 0x40, //       LD A,91; LDH (40),A  LCD on
+    0x3E, 0x05, 0xE0, 0x07, //       LD A,05; LDH (07),A  timer at 262144 Hz
+    0x3E, 0x05, 0xE0, 0xFF, //       LD A,05; LDH (FF),A  VBlank and timer interrupts
+    0xFB,                   //       EI
+    0x21, 0x00, 0xC0,       // loop: LD HL,C000
+    0x11, 0x00, 0xC1,       //       LD DE,C100
+    0x06, 0x40,             //       LD B,40
+    0x2A,                   // copy: LD A,(HL+)
+    0x80,                   //       ADD A,B
+    0x12,                   //       LD (DE),A
+    0x13,                   //       INC DE
+    0x05,                   //       DEC B
+    0x20, 0xF9,             //       JR NZ,copy
+    0xCD, 0x74, 0x01,       //       CALL sub
+    0x18, 0xEC,             //       JR loop
+    0xC5, 0xC1, 0xC9,       // sub:  PUSH BC; POP BC; RET
+};
+
+// Both interrupt handlers read a register of the component that requested them
+const std::vector<u8> vblank_handler = {0xF5, 0xF0, 0x44, 0xF1, 0xD9};
+const std::vector<u8> timer_handler = {0xF5, 0xF0, 0x05, 0xF1, 0xD9};
+
+// The loop before the scheduler, every component is updated after every
+// instruction
+void poll_cycle(GameBoy* gb) {
+    gb->cpu.execute_opcode();
+
+    gb->update_timers();
+    gb->gpu.cycle();
+    gb->apu.update();
+
+    gb->handle_interrupts();
+}
+
+// Returns the number of instructions per second
+double run(const std::string& filename, bool scheduled) {
+    GameBoy* gb = new GameBoy(filename);
+    gb->disable_bios = 1;
+    gb->cpu.PC = 0x100;
+    gb->cpu.SP = 0xFFFE;
+
+    unsigned int end_cycles = EMULATED_SECONDS * CLOCK_FREQ;
+    long instructions = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    if (scheduled) {
+        while (gb->cpu.cycles < end_cycles) {
+            gb->step();
+            instructions++;
+        }
+    } else {
+        while (gb->cpu.cycles < end_cycles) {
+            poll_cycle(gb);
+            instructions++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    delete gb;
+
+    return instructions / std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+    std::string filename = ROM_FILENAME;
+    if (argc > 1)
+        filename = argv[1];
+    else
+        write_rom(ROM_FILENAME, program, {{0x40, vblank_handler}, {0x50, timer_handler}});
+
+    double results[2];
+    for (int scheduled = 0; scheduled < 2; scheduled++)
+        results[scheduled] = best_rate_of(REPEATS, [&] { return run(filename, scheduled); });
+
+    if (argc <= 1)
+        remove(ROM_FILENAME);
+
+    printf("\n%u emulated seconds of %s\n", EMULATED_SECONDS, filename.c_str());
+    printf("%-24s %s\n", "Loop", "MIPS");
+    printf("%-24s %8.2f\n", "Poll every instruction", results[0] / 1e6);
+    printf("%-24s %8.2f\n", "Scheduler", results[1] / 1e6);
+    printf("%-24s %8.2fx\n", "Speedup", results[1] / results[0]);
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include "blockcache.h"
+
+#include <algorithm>
+
+#include "cpu.h"
+#include "gameboy.h"
+
+// Blocks are split after this many instructions
+const std::size_t MAX_BLOCK_INSTRUCTIONS = 64;
+
+// Whether this opcode can jump, call, return or stop the CPU, which ends a block
+static bool ends_block(u8 opcode) {
+    switch (opcode) {
+    case 0x10: case 0x76: // STOP, HALT
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // JP
+    case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+    case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: // RET
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+        return true;
+    default:
+        // Invalid opcodes have length 0 and never advance PC
+        return opcode_bytes[opcode] == 0;
+    }
+}
+
+BlockCache::BlockCache(GameBoy* gb) : gb(gb) {
+    current = NULL;
+    index = 0;
+}
+
+BlockCache::~BlockCache() {
+
+}
+
+const DecodedInstruction* BlockCache::fetch(u16 address) {
+    // Continue in the current block if execution simply went on to the
+    // next instruction
+    if (continues(address))
+        return &current->instructions[index++];
+
+    if (enter(address) != NULL) {
+        index = 1;
+        return &current->instructions[0];
+    }
+
+    decode(address, uncached);
+    return &uncached;
+}
+
+// Move the cursor to the start of the block at address, returns NULL if
+// the code there is not cached
+Block* BlockCache::enter(u16 address) {
+    current = NULL;
+
+    if (!cacheable(address))
+        return NULL;
+
+    Block* block = lookup(address);
+    if (block->instructions.empty())
+        return NULL;
+
+    current = block;
+    index = 0;
+
+    return block;
+}
+
+// Whether a write to address changes the code of a block in RAM, WRAM is
+// also written through its echo
+bool BlockCache::block_contains(const Block& block, u16 address) {
+    int distance = address - block.start;
+    if (address < 0xFF00)
+        distance &= 0x1FFF;
+
+    return distance >= 0 && distance < block.end - block.start;
+}
+
+// Drops the blocks in RAM which contain the written address
+void BlockCache::invalidate_ram(u16 address) {
+    std::vector<unsigned int> dropped;
+    for (unsigned int key : ram_page_blocks[ram_page(address)]) {
+        if (block_contains(blocks[key], address))
+            dropped.push_back(key);
+    }
+
+    bool pages_freed = false;
+    for (unsigned int key : dropped) {
+        Block& block = blocks[key];
+
+        for (u16 a = block.start; a < block.end; a++) {
+            std::vector<unsigned int>& page = ram_page_blocks[ram_page(a)];
+            auto it = std::find(page.begin(), page.end(), key);
+            if (it == page.end())
+                continue;
+
+            page.erase(it);
+            if (page.empty())
+                pages_freed = true;
+        }
+
+        if (current == &block)
+            current = NULL;
+        blocks.erase(key);
+    }
+
+    // Stop trapping writes to WRAM pages without code
+    if (pages_freed) {
+        gb->mmu.map_wram_writes();
+        for (int page = 0; page < 32; page++) {
+            if (!ram_page_blocks[page].empty())
+                gb->mmu.trap_wram_writes(0xC000 + (page << 8));
+        }
+    }
+}
+
+// Called when the memory mapped at the current PC may have changed,
+// e.g. after a ROM bank switch
+void BlockCache::reset_cursor() {
+    current = NULL;
+}
+
+void BlockCache::flush() {
+    blocks.clear();
+
+    for (int i = 0; i < 33; i++)
+        ram_page_blocks[i].clear();
+    gb->mmu.map_wram_writes();
+
+    current = NULL;
+}
+
+bool BlockCache::cacheable(u16 address) {
+    // The bios is only executed once at startup
+    if (address < 0x100)
+        return gb->disable_bios != 0;
+
+    return address < 0x8000 ||
+           (address >= 0xC000 && address < 0xFE00) ||
+           (address >= 0xFF80 && address < 0xFFFF);
+}
+
+u16 BlockCache::bank_for(u16 address) {
+    if (address < 0x4000)
+        return gb->mapper.rom_lower_bank;
+    if (address < 0x8000)
+        return gb->mapper.rom_upper_bank;
+
+    return 0;
+}
+
+Block* BlockCache::lookup(u16 address) {
+    u16 bank = bank_for(address);
+    unsigned int key = (bank << 16) | address;
+
+    auto it = blocks.find(key);
+    if (it != blocks.end())
+        return &it->second;
+
+    Block& block = blocks[key];
+    block.start = address;
+    block.bank = bank;
+    block.cycles = 0;
+    block.executions = 0;
+    block.untranslatable = false;
+    block.native = NULL;
+
+    // Blocks may not run into a different memory region, the memory after
+    // it could be switched or uncached
+    u16 region_end;
+    if (address < 0x4000)
+        region_end = 0x4000;
+    else if (address < 0x8000)
+        region_end = 0x8000;
+    else if (address < 0xFE00)
+        region_end = 0xFE00;
+    else
+        region_end = 0xFFFF;
+
+    u16 pc = address;
+    while (block.instructions.size() < MAX_BLOCK_INSTRUCTIONS) {
+        u8 opcode = gb->mmu.read_byte(pc);
+        int length = (opcode == 0xCB) ? 2 : opcode_bytes[opcode];
+
+        if (pc + (length > 0 ? length : 1) > region_end)
+            break;
+
+        DecodedInstruction instruction;
+        decode(pc, instruction);
+        block.instructions.push_back(instruction);
+        block.cycles += instruction.cycles;
+
+        pc += length;
+
+        if (ends_block(opcode))
+            break;
+    }
+    block.end = pc;
+
+    // Remember which RAM pages contain code, so writes to them can drop it
+    if (address >= 0x8000 && !block.instructions.empty()) {
+        for (u16 a = address; a < pc; a++) {
+            std::vector<unsigned int>& page = ram_page_blocks[ram_page(a)];
+            if (page.empty() || page.back() != key)
+                page.push_back(key);
+            if (a < 0xFE00)
+                gb->mmu.trap_wram_writes(a);
+        }
+    }
+
+    return &block;
+}
+
+void BlockCache::decode(u16 address, DecodedInstruction& instruction) {
+    MMU& mmu = gb->mmu;
+
+    instruction.address = address;
+    instruction.opcode = mmu.read_byte(address);
+    instruction.length = opcode_bytes[instruction.opcode];
+    instruction.cycles = opcode_cycles[instruction.opcode];
+
+    if (instruction.opcode == 0xCB || instruction.length == 2)
+        instruction.operand = mmu.read_byte(address + 1);
+    else if (instruction.length == 3)
+        instruction.operand = mmu.read_word(address + 1);
+    else
+        instruction.operand = 0;
+}
@@ -0,0 +1,101 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include "def.h"
+
+class CPU;
+class GameBoy;
+
+// Translated x86-64 code for a block, see dynarec.h
+typedef int (*NativeCode)(CPU* cpu);
+
+// A single instruction with its operands already fetched from memory
+struct DecodedInstruction {
+    u16 address;
+    u8 opcode;
+    u8 length; // opcode_bytes, the amount PC is advanced by after execution
+    u8 cycles; // opcode_cycles, without the extra cycles of taken branches
+    u16 operand; // d8/r8 (or the CB opcode) in the low byte, or d16/a16
+};
+
+// A straight run of instructions that ends at the first instruction which
+// can change the control flow
+struct Block {
+    u16 start;
+    u16 end; // Address directly after the last instruction
+    u16 bank;
+    int cycles; // Sum of the instruction cycles when no branch is taken
+    std::vector<DecodedInstruction> instructions;
+
+    // Dynamic recompiler state
+    int executions;
+    bool untranslatable;
+    NativeCode native;
+};
+
+/*
+    Cache of decoded basic blocks, keyed by (PC, ROM bank mapped at PC).
+
+    Only code in ROM, WRAM and HRAM is cached. The ROM can never change,
+    but blocks in RAM are dropped as soon as one of their bytes is written
+    to. Every page of RAM keeps a list of the blocks in it, so only writes
+    to those pages have to be checked.
+*/
+class BlockCache {
+public:
+    BlockCache(GameBoy* gb);
+    ~BlockCache();
+
+    const DecodedInstruction* fetch(u16 address);
+    Block* enter(u16 address);
+
+    // Whether address is the next instruction in the current block
+    bool continues(u16 address) {
+        return current != NULL && index < current->instructions.size() &&
+               current->instructions[index].address == address;
+    }
+
+    // Called by the MMU for writes to HRAM and to the WRAM pages it was told
+    // to trap, see MMU::trap_wram_writes
+    void ram_written(u16 address) {
+        if (!ram_page_blocks[ram_page(address)].empty())
+            invalidate_ram(address);
+    }
+
+    void invalidate_ram(u16 address);
+    void reset_cursor();
+    void flush();
+
+private:
+    static int ram_page(u16 address) {
+        // 32 pages of 256 bytes for WRAM (and its echo), 1 page for HRAM
+        return address >= 0xFF00 ? 32 : (address & 0x1FFF) >> 8;
+    }
+
+    static bool block_contains(const Block& block, u16 address);
+
+    bool cacheable(u16 address);
+    u16 bank_for(u16 address);
+    Block* lookup(u16 address);
+    void decode(u16 address, DecodedInstruction& instruction);
+
+public:
+    GameBoy* gb;
+
+    std::unordered_map<unsigned int, Block> blocks;
+    // Keys of the blocks with code in every page of RAM, see ram_page
+    std::vector<unsigned int> ram_page_blocks[33];
+
+    // The block that is being executed and the next instruction in it
+    Block* current;
+    std::size_t index;
+
+    // Storage for instructions executed outside of the cache
+    DecodedInstruction uncached;
+};
+
+#endif
@@ -1,33 +1,198 @@
 #include "cartridge.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include "fmt/format.h"
 
+#include "rtc.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /*
 
 No MBC: Single 32 KiB ROM bank (size 0x8000)
 MBC1: Max 2 MB ROM (128*16 KiB) and/or 32 KiB RAM
 */
 
-Cartridge::Cartridge(const std::string& filename) {
+// RAM size in bytes for each value of the header byte at 0x149
+const int RAM_SIZES[6] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+
+const std::size_t HEADER_END = 0x150;
+
+// ROM size in bytes given by the header byte at 0x148, 0 if it is unknown
+static std::size_t header_rom_size(const u8* file) {
+    if (file[0x148] > 8)
+        return 0;
+
+    return (std::size_t)(2 << file[0x148]) * ROM_BANK_SIZE;
+}
+
+// Images are at least two banks, so both ROM regions can always be mapped
+static std::size_t image_size(const u8* file) {
+    return std::max(header_rom_size(file), (std::size_t)2 * ROM_BANK_SIZE);
+}
+
+// Every open image by filename, the cartridges using it keep it alive
+static std::map<std::string, std::weak_ptr<RomImage>> rom_images;
+static std::mutex rom_images_mutex;
+
+std::shared_ptr<RomImage> RomImage::open(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(rom_images_mutex);
+
+    std::shared_ptr<RomImage> image;
+    auto it = rom_images.find(filename);
+    if (it != rom_images.end()) {
+        image = it->second.lock();
+        if (image)
+            return image;
+    }
+
+    image = std::make_shared<RomImage>();
+    image->map(filename);
+    if (image->data == NULL)
+        return NULL;
+
+    image->filename = filename;
+    rom_images[filename] = image;
+    return image;
+}
+
+// The image of an empty cartridge slot, which reads as FF
+std::shared_ptr<RomImage> RomImage::empty() {
+    std::shared_ptr<RomImage> image = std::make_shared<RomImage>();
+    image->copy.assign(2 * ROM_BANK_SIZE, 0xFF);
+    image->data = &image->copy[0];
+    image->size = image->copy.size();
+
+    return image;
+}
+
+RomImage::RomImage() {
+    data = NULL;
+    size = 0;
+    mapping = NULL;
+    mapping_size = 0;
+}
+
+RomImage::~RomImage() {
+    // Remove the image from the list, unless the file has been opened again
+    // in the meantime
+    if (!filename.empty()) {
+        std::lock_guard<std::mutex> lock(rom_images_mutex);
+        auto it = rom_images.find(filename);
+        if (it != rom_images.end() && it->second.expired())
+            rom_images.erase(it);
+    }
+
+#if !defined(_WIN32)
+    if (mapping != NULL)
+        munmap(mapping, mapping_size);
+#endif
+}
+
+void RomImage::map(const std::string& filename) {
+#if !defined(_WIN32)
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && (std::size_t)info.st_size >= HEADER_END) {
+        void* memory = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (memory != MAP_FAILED) {
+            mapping = memory;
+            mapping_size = info.st_size;
+        }
+    }
+    close(fd);
+
+    if (mapping != NULL) {
+        u8* file = (u8*)mapping;
+        std::size_t rom_size = image_size(file);
+        if (mapping_size >= rom_size) {
+            data = file;
+            size = mapping_size;
+            return;
+        }
+
+        // Pad short files with zeros, reading past the end of the mapping
+        // would crash
+        copy.assign(file, file + mapping_size);
+        copy.resize(rom_size);
+        munmap(mapping, mapping_size);
+        mapping = NULL;
+        mapping_size = 0;
+
+        data = &copy[0];
+        size = copy.size();
+        return;
+    }
+#endif
+
     std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
-    
-    if (!file.is_open()) {
+    if (!file.is_open())
+        return;
+
+    copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (copy.size() < HEADER_END)
+        return;
+
+    copy.resize(std::max(copy.size(), image_size(&copy[0])));
+    data = &copy[0];
+    size = copy.size();
+}
+
+// The save file is next to the ROM, with the extension replaced by .sav
+static std::string save_filename(const std::string& filename) {
+    std::size_t extension = filename.find_last_of('.');
+    if (extension == std::string::npos || extension < filename.find_last_of("/\\") + 1)
+        return filename + ".sav";
+
+    return filename.substr(0, extension) + ".sav";
+}
+
+Cartridge::Cartridge(const std::string& filename) {
+    // An empty slot without a memory mapper or RAM, in case the file
+    // can't be read
+    loaded = false;
+    std::fill(title, title + 16, 0);
+    std::fill(manufacturer, manufacturer + 4, 0);
+    type = 0;
+    mapper = MemoryMapper::None;
+    battery = false;
+    rtc = false;
+    rom_banks = 2;
+    ram_banks = 0;
+    ram_size = 0;
+    destination = Destination::Japanese;
+
+    rom_image = RomImage::open(filename);
+    if (!rom_image) {
         std::cout << "Cannot open the file: " << filename << std::endl;
+        rom_image = RomImage::empty();
+        rom = rom_image->data;
+        ram.allocate(0);
         return;
     }
-    
+    rom = rom_image->data;
+    loaded = true;
+
     std::cout << fmt::format("Loading cartridge: {0}", filename) << std::endl;
 
     // Read the header info
-    file.seekg(0x134);
-    file.read(title, 16);
-    file.read(manufacturer, 4);
+    std::copy(rom + 0x134, rom + 0x144, title);
+    std::copy(rom + 0x144, rom + 0x148, manufacturer);
 
-    file.seekg(0x147);
-    file.read(&type, 1);
+    type = rom[0x147];
     if (type == 0x0 || type == 0x8 || type == 0x9)
         mapper = MemoryMapper::None;
     else if (type == 0x1 || type == 0x2 || type == 0x3)
@@ -42,31 +207,36 @@ Cartridge::Cartridge(const std::string& filename) {
         mapper = MemoryMapper::MBC4;
     else if (type == 0x19 || type == 0x1A || type == 0x1B || type == 0x1C || type == 0x1D || type == 0x1E)
         mapper = MemoryMapper::MBC5;
-    else if (type == 0xFE)
+    else if (type == (char)0xFE)
         mapper = MemoryMapper::HuC1;
     else
         std::cout << fmt::format("Error: Unknown memory mapper type: {0:02X}", type) << std::endl;
 
-    char rom_size, ram_size;
-    file.read(&rom_size, 1);
-    rom_banks = 2 << rom_size;
-    file.read(&ram_size, 1);
-    ram_banks = ram_size;
-
-    char dest;
-    file.read(&dest, 1);
-    destination = (Destination::Type)dest;
-
-    // Read the ROM banks
-    file.seekg(0x0);
-    rom.resize(rom_banks * ROM_BANK_SIZE);
-    file.read((char*) &rom[0], rom_banks * ROM_BANK_SIZE);
-    //rom_0.resize(ROM_BANK_SIZE);
-    //file.read((char*) &rom_0[0], ROM_BANK_SIZE);
-    //rom_1.resize(ROM_BANK_SIZE);
-    //file.read((char*) &rom_1[0], ROM_BANK_SIZE);
-
-    // TODO: Read more banks if other memory mappers
+    battery = type == 0x3 || type == 0x6 || type == 0x9 || type == 0xD || type == 0xF ||
+              type == 0x10 || type == 0x13 || type == 0x1B || type == 0x1E || type == (char)0xFF;
+    rtc = type == 0xF || type == 0x10;
+
+    // The image holds at least as many banks as the header says
+    rom_banks = header_rom_size(rom) / ROM_BANK_SIZE;
+    if (rom_banks == 0)
+        rom_banks = rom_image->size / ROM_BANK_SIZE;
+    char ram_size_code = rom[0x149];
+    ram_size = 0;
+    // MBC2 has 512 4-bit values built in, whatever the header says
+    if (mapper == MemoryMapper::MBC2)
+        ram_size = 0x200;
+    else if (ram_size_code >= 0 && ram_size_code < 6)
+        ram_size = RAM_SIZES[(int)ram_size_code];
+    ram_banks = (ram_size + ERAM_SIZE - 1) / ERAM_SIZE;
+
+    // The clock is saved after the RAM
+    std::size_t save_size = ram_size + (rtc ? RTC_SAVE_SIZE : 0);
+    if (battery && save_size > 0)
+        ram.open(save_filename(filename), save_size);
+    else
+        ram.allocate(save_size);
+
+    destination = (Destination::Type)rom[0x14A];
 
     std::cout << "Title: " << title << std::endl;
     std::cout << "Manufacturer: " << manufacturer << std::endl;
@@ -1,10 +1,13 @@
 #ifndef CARTRIDGE_H
 #define CARTRIDGE_H
 
+#include <cstddef>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "def.h"
+#include "saveram.h"
 
 namespace MemoryMapper {
     enum Type {None, MBC1, MBC2, MBC3, MBC4, MBC5, MMM01, HuC1};
@@ -14,21 +17,63 @@ namespace Destination {
     enum Type {Japanese, NonJapanese};
 }
 
+/*
+    The contents of a ROM file, mapped read-only into memory
+
+    Images are shared: opening a file that is already open in another
+    cartridge returns the same image without touching the disk, and the
+    image is unmapped when the last cartridge using it is destroyed.
+    Changes to the file while it is open are not picked up, and truncating
+    it would crash the emulator.
+*/
+class RomImage {
+public:
+    static std::shared_ptr<RomImage> open(const std::string& filename);
+    static std::shared_ptr<RomImage> empty();
+
+    RomImage();
+    ~RomImage();
+
+public:
+    u8* data; // Read-only
+    std::size_t size; // At least the ROM size given in the header
+
+private:
+    void map(const std::string& filename);
+
+    // Key of the image in the list of open images, empty if it isn't in it
+    std::string filename;
+
+    void* mapping;
+    std::size_t mapping_size;
+    // Used instead of a mapping if the file is shorter than its header
+    // says, or on platforms without mmap
+    std::vector<u8> copy;
+};
+
 class Cartridge {
 public:
     Cartridge(const std::string& filename);
     ~Cartridge();
 
 public:
+    // Whether the file could be read, otherwise the slot is left empty
+    bool loaded;
+
     char title[16];
     char manufacturer[4];
     char type;
     MemoryMapper::Type mapper;
+    bool battery;
+    bool rtc; // MBC3 with a real time clock
     int rom_banks;
     int ram_banks;
+    std::size_t ram_size; // Without the clock state at the end of the save
     Destination::Type destination;
 
-    std::vector<u8> rom;
+    std::shared_ptr<RomImage> rom_image;
+    u8* rom;
+    SaveRam ram;
     std::vector<u8> rom_0, rom_1;
 };
 
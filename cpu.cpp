@@ -1,5 +1,6 @@
 #include "cpu.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <bitset>
@@ -9,6 +10,9 @@
 
 #include "gameboy.h"
 
+// Longest loop that skip_idle_loop() looks at, in bytes
+const int MAX_IDLE_LOOP_BYTES = 16;
+
 const std::string opcode_names[0x100] = {
     "NOP", "LD BC,d16", "LD (BC),A", "INC BC", "INC B", "DEC B", "LD B,d8", "RLCA", "LD (a16),SP", "ADD HL,BC", "LD A,(BC)", "DEC BC", "INC C", "DEC C", "LD C,d8", "RRCA",
     "STOP 0", "LD DE,d16", "LD (DE),A", "INC DE", "INC D", "DEC D", "LD D,d8", "RLA", "JR r8", "ADD HL,DE", "LD A,(DE)", "DEC DE", "INC E", "DEC E", "LD E,d8", "RRA",
@@ -91,20 +95,7 @@ const std::string opcode_names_cb[0x100] = {
     "SET 6,B", "SET 6,C", "SET 6,D", "SET 6,E", "SET 6,H", "SET 6,L", "SET 6,(HL)", "SET 6,A", "SET 7,B", "SET 7,C", "SET 7,D", "SET 7,E", "SET 7,H", "SET 7,L", "SET 7,(HL)", "SET 7,A",
 };
 
-Register16::Register16() : upper(NULL), lower(NULL) {}
-
-Register16::Register16(u8* upper, u8* lower) : upper(upper), lower(lower) {}
-
-u16 Register16::get() {
-    return (*upper << 8) | *lower;
-}
-
-void Register16::set(u16 value) {
-    *upper = value >> 8;
-    *lower = value & 0x00FF;
-}
-
-CPU::CPU(GameBoy* gb) : gb(gb) {
+CPU::CPU(GameBoy* gb) : gb(gb), block_cache(gb), dynarec(gb) {
     cycles = 0;
     elapsed_cycles = 0;
 
@@ -113,15 +104,25 @@ CPU::CPU(GameBoy* gb) : gb(gb) {
 
     halted = false;
 
+    skip_idle_loops = false;
+    idle_loop_start = 0;
+    idle_loop_cycles = 0;
+    idle_loop_event = 0;
+    idle_loop_writes = 0;
+    for (int i = 0; i < 5; i++)
+        idle_loop_registers[i] = 0;
+
+    operand = 0;
+
     A = F = 0;
     B = C = 0;
     D = E = 0;
     H = L = 0;
 
-    AF = Register16(&A, &F);
-    BC = Register16(&B, &C);
-    DE = Register16(&D, &E);
-    HL = Register16(&H, &L);
+    flag_op = FlagOp::None;
+    flag_a = flag_b = 0;
+    flag_result = 0;
+    flag_carry = false;
 
     PC = 0x0;
     SP = 0x0;
@@ -134,14 +135,33 @@ CPU::~CPU() {
 }
 
 void CPU::set_flag(int flag, bool value) {
+    materialize_flags();
+
     if (value)
         F |= flag;
     else
         F &= ~flag;
 }
 
+// Brings F up to date with the pending flags of the last operation
+void CPU::materialize_flags() {
+    if (flag_op == FlagOp::None)
+        return;
+
+    u8 flags = (get_zero() ? FLAG_ZERO : 0) |
+               (get_subtract() ? FLAG_SUBTRACT : 0) |
+               (get_half_carry() ? FLAG_HALF_CARRY : 0) |
+               (get_carry() ? FLAG_CARRY : 0);
+
+    F = (F & 0x0F) | flags;
+    flag_op = FlagOp::None;
+}
+
 bool CPU::get_zero() {
-    return (F & FLAG_ZERO) != 0;
+    if (flag_op == FlagOp::None)
+        return (F & FLAG_ZERO) != 0;
+
+    return (flag_result & 0xFF) == 0;
 }
 
 void CPU::set_zero(bool value) {
@@ -149,7 +169,14 @@ void CPU::set_zero(bool value) {
 }
 
 bool CPU::get_subtract() {
-    return (F & FLAG_SUBTRACT) != 0;
+    switch (flag_op) {
+    case FlagOp::None:
+        return (F & FLAG_SUBTRACT) != 0;
+    case FlagOp::Sub: case FlagOp::Sbc: case FlagOp::Dec:
+        return true;
+    default:
+        return false;
+    }
 }
 
 void CPU::set_subtract(bool value) {
@@ -157,7 +184,26 @@ void CPU::set_subtract(bool value) {
 }
 
 bool CPU::get_half_carry() {
-    return (F & FLAG_HALF_CARRY) != 0;
+    switch (flag_op) {
+    case FlagOp::None:
+        return (F & FLAG_HALF_CARRY) != 0;
+    case FlagOp::Add: case FlagOp::Inc:
+        return (flag_result & 0x0F) < (flag_a & 0x0F);
+    case FlagOp::Adc:
+        // Add all lower 4 bits separately, else the carry can already occur in
+        // for example (value+carry) but not in the final result
+        return ((flag_a & 0xF) + (flag_b & 0xF) + flag_carry) > 0xF;
+    case FlagOp::Sub:
+        return (flag_result & 0x0F) > (flag_a & 0x0F);
+    case FlagOp::Sbc:
+        return ((flag_a & 0xF) - (flag_b & 0xF) - flag_carry) < 0;
+    case FlagOp::Dec:
+        return (flag_a & 0xF) < 0x1;
+    case FlagOp::And: case FlagOp::Bit:
+        return true;
+    default:
+        return false;
+    }
 }
 
 void CPU::set_half_carry(bool value) {
@@ -165,7 +211,18 @@ void CPU::set_half_carry(bool value) {
 }
 
 bool CPU::get_carry() {
-    return (F & FLAG_CARRY) != 0;
+    switch (flag_op) {
+    case FlagOp::None:
+        return (F & FLAG_CARRY) != 0;
+    case FlagOp::Add: case FlagOp::Adc:
+        return flag_result > 0xFF;
+    case FlagOp::Sub: case FlagOp::Sbc:
+        return flag_result < 0;
+    case FlagOp::And: case FlagOp::Or:
+        return false;
+    default:
+        return flag_carry;
+    }
 }
 
 void CPU::set_carry(bool value) {
@@ -194,6 +251,60 @@ void CPU::handle_interrupt(u16 handler_address) {
     cycles += 12;
 }
 
+/*
+    Called after a short backward jump. Games often wait for the GPU in a
+    loop like
+
+        wait: LDH A,(FF44)
+              CP 90
+              JR NZ,wait
+
+    If the loop comes back to the same start with the same registers, without
+    writing memory, while only reading IF and the GPU registers and without a
+    GPU or timer event in between, the next iterations are going to be
+    identical until the next event. So all of them can be skipped at once.
+
+    Returns the number of cycles that were skipped.
+*/
+int CPU::skip_idle_loop() {
+    MMU& mmu = gb->mmu;
+    u16 registers[5] = {AF.get(), BC.get(), DE.get(), HL.get(), SP};
+
+    int available = std::max(gb->cycles_until_event(), 0);
+    unsigned int next_event = cycles + available;
+
+    bool repeated = PC == idle_loop_start &&
+                    cycles <= idle_loop_event &&
+                    mmu.write_count == idle_loop_writes &&
+                    !mmu.volatile_read;
+    for (int i = 0; i < 5 && repeated; i++)
+        repeated = registers[i] == idle_loop_registers[i];
+
+    int iteration_cycles = cycles - idle_loop_cycles;
+    int skipped = 0;
+
+    if (repeated) {
+        if (available > iteration_cycles) {
+            skipped = available / iteration_cycles * iteration_cycles;
+            cycles += skipped;
+            elapsed_cycles += skipped;
+            gb->stats.idle_cycles_skipped += skipped;
+        }
+    } else {
+        // Start watching this loop
+        idle_loop_start = PC;
+        for (int i = 0; i < 5; i++)
+            idle_loop_registers[i] = registers[i];
+    }
+
+    idle_loop_cycles = cycles;
+    idle_loop_event = next_event;
+    idle_loop_writes = mmu.write_count;
+    mmu.volatile_read = false;
+
+    return skipped;
+}
+
 u8 CPU::current_opcode() {
     return gb->mmu.read_byte(PC);
 }
@@ -201,6 +312,8 @@ u8 CPU::current_opcode() {
 void CPU::debug_print() {
     u8 opcode = current_opcode();
 
+    materialize_flags();
+
     std::string opcode_name = opcode_names[opcode];
     if (opcode == 0xCB)
         opcode_name = opcode_names_cb[opcode];
@@ -249,62 +362,46 @@ void CPU::execute_ALU_opcode(u8 opcode, bool immediate) {
     } else // Value of a register
         value = *r[z];
 
+    bool carry;
+
     switch (y) {
     case 0: // ADD
         result = A + value;
-        set_subtract(false);
-        set_half_carry((result & 0x0F) < (A & 0x0F));
-        set_carry(result > 0xFF);
+        set_flags_lazy(FlagOp::Add, A, value, result, false);
         A = result & 0xFF;
-        set_zero(A == 0);
         break;
     case 1: // ADC
-        result = A + value + get_carry();
-        set_subtract(false);
-        // Add all lower 4 bits separately, else the carry can already occur in
-        // for example (value+carry) but not in the final result
-        set_half_carry(((A & 0xF) + (value & 0xF) + get_carry()) > 0xF);
-        set_carry(result > 0xFF);
+        carry = get_carry();
+        result = A + value + carry;
+        set_flags_lazy(FlagOp::Adc, A, value, result, carry);
         A = result & 0xFF;
-        set_zero(A == 0);
         break;
     case 2: // SUB
         result = A - value;
-        set_subtract(true);
-        set_half_carry((result & 0x0F) > (A & 0x0F));
-        set_carry(result < 0);
+        set_flags_lazy(FlagOp::Sub, A, value, result, false);
         A = result & 0xFF;
-        set_zero(A == 0);
         break;
     case 3: // SBC
-        result = A - value - get_carry();
-        set_subtract(true);
-        set_half_carry(((A & 0xF) - (value & 0xF) - get_carry()) < 0);
-        set_carry(result < 0);
+        carry = get_carry();
+        result = A - value - carry;
+        set_flags_lazy(FlagOp::Sbc, A, value, result, carry);
         A = result & 0xFF;
-        set_zero(A == 0);
         break;
     case 4: // AND
         A &= value;
-        set_zero(A == 0);
-        set_subtract(false); set_half_carry(true); set_carry(false);
+        set_flags_lazy(FlagOp::And, 0, 0, A, false);
         break;
     case 5: // XOR
         A ^= value;
-        set_zero(A == 0);
-        set_subtract(false); set_half_carry(false); set_carry(false);
+        set_flags_lazy(FlagOp::Or, 0, 0, A, false);
         break;
     case 6: // OR
         A |= value;
-        set_zero(A == 0);
-        set_subtract(false); set_half_carry(false); set_carry(false);
+        set_flags_lazy(FlagOp::Or, 0, 0, A, false);
         break;
-    case 7: // CP
+    case 7: // CP, a SUB that only sets the flags
         result = A - value;
-        set_zero(result == 0);
-        set_subtract(true); // Changed to true
-        set_half_carry((result & 0x0F) > (A & 0x0F));
-        set_carry(result < 0);
+        set_flags_lazy(FlagOp::Sub, A, value, result, false);
         break;
     }
 }
@@ -329,49 +426,41 @@ void CPU::execute_CB_opcode(u8 opcode) {
         switch (y) {
         case 0: // RLC
             result = (value << 1) | (value >> 7);
-            set_zero((result & 0xFF) == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value >> 7);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value >> 7);
             break;
         case 1: // RRC
             result = (value >> 1) | (value << 7);
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value & 0x1);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value & 0x1);
             break;
         case 2: // RL
             result = (value << 1) | get_carry();
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value >> 7);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value >> 7);
             break;
         case 3: // RR
             result = (value >> 1) | (get_carry() << 7);
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value & 0x1);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value & 0x1);
             break;
         case 4: // SLA
             result = value << 1;
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value >> 7);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value >> 7);
             break;
         case 5: // SRA
             result = (value >> 1) | (value & 0b10000000);
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value & 0x1);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value & 0x1);
             break;
         case 6: // SWAP
             result = (value << 4) | (value >> 4);
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(false);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, false);
             break;
         case 7: // SRL
             result = value >> 1;
-            set_zero(result == 0); set_subtract(false);
-            set_half_carry(false); set_carry(value & 0x1);
+            set_flags_lazy(FlagOp::Shift, 0, 0, result, value & 0x1);
             break;
         }
         break;
     case 1: // BIT
         result = value & (1 << y);
-        set_zero(result == 0); set_subtract(false); set_half_carry(true);
+        set_flags_lazy(FlagOp::Bit, 0, 0, result, get_carry());
         break;
     case 2: // RES
         result = value & ~(1 << y);
@@ -402,14 +491,12 @@ void CPU::execute_CB_opcode(u8 opcode) {
 // 09: pass
 // 10: pass
 // 11: DAA
-void CPU::execute_opcode() {
-    u8 opcode = gb->mmu.read_byte(PC);
-
+void CPU::decode_opcode(u8 opcode) {
     // Some arrays of registers and flags which make generalizing
     // instructions easier
     u8* r[8] = {&B, &C, &D, &E, &H, &L, NULL, &A};
-    Register16 rp[3] = {BC, DE, HL};
-    Register16 rp2[4] = {BC, DE, HL, AF};
+    Register16* rp[3] = {&BC, &DE, &HL};
+    Register16* rp2[4] = {&BC, &DE, &HL, &AF};
     bool cc[4] = {!get_zero(), get_zero(), !get_carry(), get_carry()};
 
     // These parameters allow grouping by positions in a 16x16 opcode table
@@ -425,407 +512,869 @@ void CPU::execute_opcode() {
     int result = 0;
     int a = 0;
 
-    if (gb->debug_mode) {
-        debug_print();
-    }
-
-    elapsed_cycles = 0;
-
     // Switch per block of 4 rows
-    if (!halted) {
-        switch (x) {
-        case 0: // Rows 0-3
-            // Switch per position in half-row
-            switch (z) {
-            case 0:
-                // Switch per position of half-row in 4-row block
-                switch (y) {
-                case 0: // NOP
-                    break;
-                case 1: // LD (a16), SP
-                    gb->mmu.write_word(gb->mmu.read_word(PC + 1), SP);
-                    break;
-                case 2: // STOP 0
+    switch (x) {
+    case 0: // Rows 0-3
+        // Switch per position in half-row
+        switch (z) {
+        case 0:
+            // Switch per position of half-row in 4-row block
+            switch (y) {
+            case 0: // NOP
+                break;
+            case 1: // LD (a16), SP
+                gb->mmu.write_word(gb->mmu.read_word(PC + 1), SP);
+                break;
+            case 2: // STOP 0
 
-                    break;
-                case 3: // JR r8
+                break;
+            case 3: // JR r8
+                result = gb->mmu.read_byte(PC + 1);
+                if (result >= 128)
+                    result -= 256;
+                PC += result;
+                break;
+            case 4: case 5: case 6: case 7: // JR cc[y-4], r8
+                if (cc[y - 4]) {
                     result = gb->mmu.read_byte(PC + 1);
                     if (result >= 128)
                         result -= 256;
                     PC += result;
-                    break;
-                case 4: case 5: case 6: case 7: // JR cc[y-4], r8
-                    if (cc[y - 4]) {
-                        result = gb->mmu.read_byte(PC + 1);
-                        if (result >= 128)
-                            result -= 256;
-                        PC += result;
-                        elapsed_cycles += 4;
-                    }
-                    break;
-                }
-                break;
-            case 1:
-                switch (q) {
-                case 0: // LD rp[p], d16
-                    if (p < 3)
-                        rp[p].set(gb->mmu.read_word(PC + 1));
-                    else
-                        SP = gb->mmu.read_word(PC + 1);
-                    break;
-                case 1: // ADD HL, rp[p]
-                    u16 prev = HL.get();
-                    int result;
-                    if (p < 3)
-                        result = prev + rp[p].get();
-                    else
-                        result = prev + SP;
-                    set_subtract(false);
-                    set_half_carry((result & 0xFFF) < (prev & 0xFFF));
-                    set_carry(result > 0xFFFF);
-                    HL.set(result & 0xFFFF);
-                    break;
+                    elapsed_cycles += 4;
                 }
                 break;
-            case 2:
-                switch (q) {
-                case 0:
-                    switch (p) {
-                    case 0: // LD (BC),A
-                        gb->mmu.write_byte(BC.get(), A);
-                        break;
-                    case 1: // LD (DE),A
-                        gb->mmu.write_byte(DE.get(), A);
-                        break;
-                    case 2: // LD (HL+),A
-                        gb->mmu.write_byte(HL.get(), A);
-                        HL.set(HL.get() + 1);
-                        break;
-                    case 3: // LD (HL-),A
-                        gb->mmu.write_byte(HL.get(), A);
-                        HL.set(HL.get() - 1);
-                        break;
-                    }
-                    break;
-                case 1:
-                    switch (p) {
-                    case 0: // LD A,(BC)
-                        A = gb->mmu.read_byte(BC.get());
-                        break;
-                    case 1: // LD A,(DE)
-                        A = gb->mmu.read_byte(DE.get());
-                        break;
-                    case 2: // LD A,(HL+)
-                        A = gb->mmu.read_byte(HL.get());
-                        HL.set(HL.get() + 1);
-                        break;
-                    case 3: // LD A,(HL-)
-                        A = gb->mmu.read_byte(HL.get());
-                        HL.set(HL.get() - 1);
-                        break;
-                    }
-                    break;
-                }
-                break;
-            case 3:
-                switch (q) {
-                case 0: // INC rp[p]
-                    if (p < 3)
-                        rp[p].set(rp[p].get() + 1);
-                    else
-                        SP++;
-                    break;
-                case 1: // DEC rp[p]
-                    if (p < 3)
-                        rp[p].set(rp[p].get() - 1);
-                    else
-                        SP--;
-                    break;
-                }
+            }
+            break;
+        case 1:
+            switch (q) {
+            case 0: // LD rp[p], d16
+                if (p < 3)
+                    rp[p]->set(gb->mmu.read_word(PC + 1));
+                else
+                    SP = gb->mmu.read_word(PC + 1);
                 break;
-            case 4: // INC r[y]
-                if (y == 6) {
-                    prev = gb->mmu.read_byte(HL.get());
-                    result = prev + 1;
-                    gb->mmu.write_byte(HL.get(), result & 0xFF);
-                } else {
-                    prev = *r[y];
-                    result = prev + 1;
-                    *r[y] = result & 0xFF;
-                }
-                set_zero((result & 0xFF) == 0);
+            case 1: // ADD HL, rp[p]
+                u16 prev = HL.get();
+                int result;
+                if (p < 3)
+                    result = prev + rp[p]->get();
+                else
+                    result = prev + SP;
                 set_subtract(false);
-                set_half_carry((result & 0xF) < (prev & 0xF));
+                set_half_carry((result & 0xFFF) < (prev & 0xFFF));
+                set_carry(result > 0xFFFF);
+                HL.set(result & 0xFFFF);
                 break;
-            case 5: // DEC r[y]
-                if (y == 6) {
-                    prev = gb->mmu.read_byte(HL.get());
-                    result = prev - 1;
-                    gb->mmu.write_byte(HL.get(), result & 0xFF);
-                } else {
-                    prev = *r[y];
-                    result = prev - 1;
-                    *r[y] = result & 0xFF;
-                }
-                set_zero((result & 0xFF) == 0);
-                set_subtract(true);
-                set_half_carry((prev & 0xF) < 0x1);
-                break;
-            case 6: // LD r[y],d8
-                prev = gb->mmu.read_byte(PC + 1);
-                if (y == 6)
-                    gb->mmu.write_byte(HL.get(), prev);
-                else
-                    *r[y] = prev;
-                break;
-            case 7:
-                switch (y) {
-                case 0: // RLCA
-                    set_zero(false); set_subtract(false); set_half_carry(false);
-                    set_carry(A >> 7);
-                    A = (A << 1) | (A >> 7);
+            }
+            break;
+        case 2:
+            switch (q) {
+            case 0:
+                switch (p) {
+                case 0: // LD (BC),A
+                    gb->mmu.write_byte(BC.get(), A);
                     break;
-                case 1: // RRCA
-                    set_zero(false); set_subtract(false); set_half_carry(false);
-                    set_carry(A & 0x1);
-                    A = (A >> 1) | ((A & 0x1) << 7);
+                case 1: // LD (DE),A
+                    gb->mmu.write_byte(DE.get(), A);
                     break;
-                case 2: // RLA
-                    set_zero(false); set_subtract(false); set_half_carry(false);
-                    result = A << 1 | get_carry();
-                    set_carry(A >> 7);
-                    A = result & 0xFF;
+                case 2: // LD (HL+),A
+                    gb->mmu.write_byte(HL.get(), A);
+                    HL.set(HL.get() + 1);
                     break;
-                case 3: // RRA
-                    set_zero(false); set_subtract(false); set_half_carry(false);
-                    result = A >> 1 | get_carry() << 7;
-                    set_carry(A & 0x1);
-                    A = result & 0xFF;
+                case 3: // LD (HL-),A
+                    gb->mmu.write_byte(HL.get(), A);
+                    HL.set(HL.get() - 1);
                     break;
-                case 4: // DAA
-                    a = A;
-                    if (!get_subtract()) {
-                        if (get_half_carry() || (a & 0xF) > 9)
-                            a += 0x06;
-                        if (get_carry() || a > 0x9F)
-                            a += 0x60;
-                    } else {
-                        if (get_half_carry())
-                            a = (a - 6) & 0xFF;
-                        if (get_carry())
-                            a -= 0x60;
-                    }
-
-                    set_half_carry(false);
-
-                    if ((a & 0x100) == 0x100)
-                        set_carry(true);
-
-                    A = a & 0xFF;
-                    set_zero(A == 0);
+                }
+                break;
+            case 1:
+                switch (p) {
+                case 0: // LD A,(BC)
+                    A = gb->mmu.read_byte(BC.get());
                     break;
-                case 5: // CPL
-                    A = ~A;
-                    set_subtract(true);
-                    set_half_carry(true);
+                case 1: // LD A,(DE)
+                    A = gb->mmu.read_byte(DE.get());
                     break;
-                case 6: // SCF
-                    set_subtract(false);
-                    set_half_carry(false);
-                    set_carry(true);
+                case 2: // LD A,(HL+)
+                    A = gb->mmu.read_byte(HL.get());
+                    HL.set(HL.get() + 1);
                     break;
-                case 7: // CCF
-                    set_subtract(false);
-                    set_half_carry(false);
-                    set_carry(!get_carry());
+                case 3: // LD A,(HL-)
+                    A = gb->mmu.read_byte(HL.get());
+                    HL.set(HL.get() - 1);
                     break;
                 }
                 break;
             }
             break;
-        case 1: // Rows 4-7: LD instructions and HALT
-            if (z == 6 && y == 6) { // HALT
-                halted = true;
-                //std::cout << "halting! ime=" << interrupt_master_enable << std::endl;
-            } else // LD r[y], r[z]
-                if (y == 6)
-                    gb->mmu.write_byte(HL.get(), *r[z]);
-                else if (z == 6)
-                    *r[y] = gb->mmu.read_byte(HL.get());
+        case 3:
+            switch (q) {
+            case 0: // INC rp[p]
+                if (p < 3)
+                    rp[p]->set(rp[p]->get() + 1);
                 else
-                    *r[y] = *r[z];
+                    SP++;
+                break;
+            case 1: // DEC rp[p]
+                if (p < 3)
+                    rp[p]->set(rp[p]->get() - 1);
+                else
+                    SP--;
+                break;
+            }
             break;
-        case 2: // Rows 8-11: arithmetic functions ALU[y] r[z]
-            execute_ALU_opcode(opcode, false);
+        case 4: // INC r[y]
+            if (y == 6) {
+                prev = gb->mmu.read_byte(HL.get());
+                result = prev + 1;
+                gb->mmu.write_byte(HL.get(), result & 0xFF);
+            } else {
+                prev = *r[y];
+                result = prev + 1;
+                *r[y] = result & 0xFF;
+            }
+            set_flags_lazy(FlagOp::Inc, prev, 0, result, get_carry());
             break;
-        case 3: // Rows 12-15
-            switch (z) {
-            case 0:
-                switch (y) {
-                case 0: case 1: case 2: case 3: // RET cc[y]
-                    if (cc[y]) {
-                        PC = pop_from_stack() - 1;
-                        elapsed_cycles += 12;
-                    }
-                    break;
-                case 4: // LDH (a8),A
-                    gb->mmu.write_byte(0xFF00 + gb->mmu.read_byte(PC + 1), A);
-                    break;
-                case 5: // ADD SP,r8
-                    result = gb->mmu.read_byte(PC + 1);
+        case 5: // DEC r[y]
+            if (y == 6) {
+                prev = gb->mmu.read_byte(HL.get());
+                result = prev - 1;
+                gb->mmu.write_byte(HL.get(), result & 0xFF);
+            } else {
+                prev = *r[y];
+                result = prev - 1;
+                *r[y] = result & 0xFF;
+            }
+            set_flags_lazy(FlagOp::Dec, prev, 0, result, get_carry());
+            break;
+        case 6: // LD r[y],d8
+            prev = gb->mmu.read_byte(PC + 1);
+            if (y == 6)
+                gb->mmu.write_byte(HL.get(), prev);
+            else
+                *r[y] = prev;
+            break;
+        case 7:
+            switch (y) {
+            case 0: // RLCA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                set_carry(A >> 7);
+                A = (A << 1) | (A >> 7);
+                break;
+            case 1: // RRCA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                set_carry(A & 0x1);
+                A = (A >> 1) | ((A & 0x1) << 7);
+                break;
+            case 2: // RLA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                result = A << 1 | get_carry();
+                set_carry(A >> 7);
+                A = result & 0xFF;
+                break;
+            case 3: // RRA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                result = A >> 1 | get_carry() << 7;
+                set_carry(A & 0x1);
+                A = result & 0xFF;
+                break;
+            case 4: // DAA
+                a = A;
+                if (!get_subtract()) {
+                    if (get_half_carry() || (a & 0xF) > 9)
+                        a += 0x06;
+                    if (get_carry() || a > 0x9F)
+                        a += 0x60;
+                } else {
+                    if (get_half_carry())
+                        a = (a - 6) & 0xFF;
+                    if (get_carry())
+                        a -= 0x60;
+                }
 
-                    // Calculate two's complement of the byte
-                    if (result >= 128)
-                        result -= 256;
+                set_half_carry(false);
+
+                if ((a & 0x100) == 0x100)
+                    set_carry(true);
+
+                A = a & 0xFF;
+                set_zero(A == 0);
+                break;
+            case 5: // CPL
+                A = ~A;
+                set_subtract(true);
+                set_half_carry(true);
+                break;
+            case 6: // SCF
+                set_subtract(false);
+                set_half_carry(false);
+                set_carry(true);
+                break;
+            case 7: // CCF
+                set_subtract(false);
+                set_half_carry(false);
+                set_carry(!get_carry());
+                break;
+            }
+            break;
+        }
+        break;
+    case 1: // Rows 4-7: LD instructions and HALT
+        if (z == 6 && y == 6) { // HALT
+            halted = true;
+            //std::cout << "halting! ime=" << interrupt_master_enable << std::endl;
+        } else // LD r[y], r[z]
+            if (y == 6)
+                gb->mmu.write_byte(HL.get(), *r[z]);
+            else if (z == 6)
+                *r[y] = gb->mmu.read_byte(HL.get());
+            else
+                *r[y] = *r[z];
+        break;
+    case 2: // Rows 8-11: arithmetic functions ALU[y] r[z]
+        execute_ALU_opcode(opcode, false);
+        break;
+    case 3: // Rows 12-15
+        switch (z) {
+        case 0:
+            switch (y) {
+            case 0: case 1: case 2: case 3: // RET cc[y]
+                if (cc[y]) {
+                    PC = pop_from_stack() - 1;
+                    elapsed_cycles += 12;
+                }
+                break;
+            case 4: // LDH (a8),A
+                gb->mmu.write_byte(0xFF00 + gb->mmu.read_byte(PC + 1), A);
+                break;
+            case 5: // ADD SP,r8
+                result = gb->mmu.read_byte(PC + 1);
 
-                    result = SP + result;
+                // Calculate two's complement of the byte
+                if (result >= 128)
+                    result -= 256;
 
-                    set_zero(false);
-                    set_subtract(false);
-                    // Half carry if there is a carry from bit 3 to 4
-                    set_half_carry((result & 0x000F) < (SP & 0x000F));
-                    // Carry if there is a carry from bit 11 to 12
-                    set_carry((result & 0x00FF) < (SP & 0x00FF));
+                result = SP + result;
 
-                    SP = result & 0xFFFF;
-                    break;
-                case 6: // LDH A,(a8)
-                    A = gb->mmu.read_byte(0xFF00 + gb->mmu.read_byte(PC + 1));
-                    break;
-                case 7: // LD HL,SP+r8
-                    //A = gb->mmu.read_byte(gb->mmu.read_word(PC + 1));
+                set_zero(false);
+                set_subtract(false);
+                // Half carry if there is a carry from bit 3 to 4
+                set_half_carry((result & 0x000F) < (SP & 0x000F));
+                // Carry if there is a carry from bit 11 to 12
+                set_carry((result & 0x00FF) < (SP & 0x00FF));
 
-                    result = gb->mmu.read_byte(PC + 1);
+                SP = result & 0xFFFF;
+                break;
+            case 6: // LDH A,(a8)
+                A = gb->mmu.read_byte(0xFF00 + gb->mmu.read_byte(PC + 1));
+                break;
+            case 7: // LD HL,SP+r8
+                //A = gb->mmu.read_byte(gb->mmu.read_word(PC + 1));
 
-                    // Calculate two's complement of the byte
-                    if (result >= 128)
-                        result -= 256;
+                result = gb->mmu.read_byte(PC + 1);
 
-                    result = SP + result;
+                // Calculate two's complement of the byte
+                if (result >= 128)
+                    result -= 256;
 
-                    set_zero(false);
-                    set_subtract(false);
-                    // Half carry if there is a carry from bit 3 to 4
-                    set_half_carry((result & 0x000F) < (SP & 0x000F));
-                    // Carry if there is a carry from bit 11 to 12
-                    set_carry((result & 0x00FF) < (SP & 0x00FF));
+                result = SP + result;
 
-                    HL.set(result & 0xFFFF);
-                    break;
-                }
+                set_zero(false);
+                set_subtract(false);
+                // Half carry if there is a carry from bit 3 to 4
+                set_half_carry((result & 0x000F) < (SP & 0x000F));
+                // Carry if there is a carry from bit 11 to 12
+                set_carry((result & 0x00FF) < (SP & 0x00FF));
+
+                HL.set(result & 0xFFFF);
                 break;
-            case 1:
-                switch (q) {
-                case 0: // POP rp2[p]
-                    result = pop_from_stack();
-                    rp2[p].set(result);
-
-                    // When popping AF, the unused lower 4 bits of F can be set
-                    // so set those all to zero
-                    if (p == 3) {
-                        F &= 0xF0;
-                    }
-                    break;
-                case 1:
-                    switch (p) {
-                    case 0: // RET
-                        PC = pop_from_stack() - 1;
-                        break;
-                    case 1: // RETI
-                        gb->interrupt_master_enable = true;
-                        PC = pop_from_stack() - 1;
-                        break;
-                    case 2: // JP (HL)
-                        PC = HL.get() - 1;
-                        break;
-                    case 3: // LD SP,HL
-                        SP = HL.get();
-                        break;
-                    }
+            }
+            break;
+        case 1:
+            switch (q) {
+            case 0: // POP rp2[p]
+                result = pop_from_stack();
+                rp2[p]->set(result);
+
+                // When popping AF, the unused lower 4 bits of F can be set
+                // so set those all to zero
+                if (p == 3) {
+                    F &= 0xF0;
+                    flag_op = FlagOp::None;
                 }
                 break;
-            case 2: // JP cc[y],nn // LIMIT TO UPPER 4
-                switch (y) {
-                case 0: case 1: case 2: case 3:
-                    if (cc[y]) {
-                        PC = gb->mmu.read_word(PC + 1) - 3;
-                        elapsed_cycles += 4;
-                    }
-                    break;
-                case 4: // LD (FF00+C), A
-                    gb->mmu.write_byte(0xFF00 + C, A);
+            case 1:
+                switch (p) {
+                case 0: // RET
+                    PC = pop_from_stack() - 1;
                     break;
-                case 5: // LD (a16), A
-                    gb->mmu.write_byte(gb->mmu.read_word(PC + 1), A);
+                case 1: // RETI
+                    gb->interrupt_master_enable = true;
+                    PC = pop_from_stack() - 1;
                     break;
-                case 6: // LD A, (FF00+C)
-                    A = gb->mmu.read_byte(0xFF00 + C);
+                case 2: // JP (HL)
+                    PC = HL.get() - 1;
                     break;
-                case 7: // LD A, (a16)
-                    A = gb->mmu.read_byte(gb->mmu.read_word(PC + 1));
+                case 3: // LD SP,HL
+                    SP = HL.get();
                     break;
                 }
-                break;
-            case 3:
-                switch (y) {
-                case 0: // JP nn
+            }
+            break;
+        case 2: // JP cc[y],nn // LIMIT TO UPPER 4
+            switch (y) {
+            case 0: case 1: case 2: case 3:
+                if (cc[y]) {
                     PC = gb->mmu.read_word(PC + 1) - 3;
-                    break;
-                case 1: // CB PREFIX
-                    execute_CB_opcode(gb->mmu.read_byte(PC + 1));
+                    elapsed_cycles += 4;
+                }
+                break;
+            case 4: // LD (FF00+C), A
+                gb->mmu.write_byte(0xFF00 + C, A);
+                break;
+            case 5: // LD (a16), A
+                gb->mmu.write_byte(gb->mmu.read_word(PC + 1), A);
+                break;
+            case 6: // LD A, (FF00+C)
+                A = gb->mmu.read_byte(0xFF00 + C);
+                break;
+            case 7: // LD A, (a16)
+                A = gb->mmu.read_byte(gb->mmu.read_word(PC + 1));
+                break;
+            }
+            break;
+        case 3:
+            switch (y) {
+            case 0: // JP nn
+                PC = gb->mmu.read_word(PC + 1) - 3;
+                break;
+            case 1: // CB PREFIX
+                execute_CB_opcode(gb->mmu.read_byte(PC + 1));
 
-                    // Every CB instruction is length 2
-                    PC += 1;
+                // Every CB instruction is length 2
+                PC += 1;
+                elapsed_cycles += 8;
+                if (z == 0x6 || z == 0xE)
                     elapsed_cycles += 8;
-                    if (z == 0x6 || z == 0xE)
-                        elapsed_cycles += 8;
-                    break;
-                case 6: // DI
-                    gb->interrupt_master_enable = false;
-                    break;
-                case 7: // EI
-                    gb->interrupt_master_enable = true;
-                    break;
-                }
                 break;
-            case 4: // CALL cc[y],nn
-                if (y < 4 && cc[y]) {
-                    push_to_stack(PC + 3);
-                    PC = gb->mmu.read_word(PC + 1) - 3;
-                    elapsed_cycles += 12;
-                }
+            case 6: // DI
+                gb->interrupt_master_enable = false;
                 break;
-            case 5:
-                switch (q) {
-                case 0: // PUSH rp2[p]
-                    push_to_stack(rp2[p].get());
-                    break;
-                case 1:
-                    if (p == 0) { // CALL nn
-                        push_to_stack(PC + 3);
-                        PC = gb->mmu.read_word(PC + 1) - 3;
-                    }
-                    break;
-                }
+            case 7: // EI
+                gb->interrupt_master_enable = true;
                 break;
-            case 6: // alu[y] n
-                execute_ALU_opcode(opcode, true);
+            }
+            break;
+        case 4: // CALL cc[y],nn
+            if (y < 4 && cc[y]) {
+                push_to_stack(PC + 3);
+                PC = gb->mmu.read_word(PC + 1) - 3;
+                elapsed_cycles += 12;
+            }
+            break;
+        case 5:
+            switch (q) {
+            case 0: // PUSH rp2[p]
+                if (p == 3)
+                    materialize_flags();
+                push_to_stack(rp2[p]->get());
                 break;
-            case 7: // RST y*8
-                //interrupt_master_enable = false;
-                push_to_stack(PC + 1);
-                PC = y * 8 - 1;
+            case 1:
+                if (p == 0) { // CALL nn
+                    push_to_stack(PC + 3);
+                    PC = gb->mmu.read_word(PC + 1) - 3;
+                }
                 break;
             }
             break;
+        case 6: // alu[y] n
+            execute_ALU_opcode(opcode, true);
+            break;
+        case 7: // RST y*8
+            //interrupt_master_enable = false;
+            push_to_stack(PC + 1);
+            PC = y * 8 - 1;
+            break;
+        }
+        break;
+    }
+}
+
+// Operand accessors for the dispatch handlers. The register index follows
+// the opcode table layout: B, C, D, E, H, L, (HL), A
+template <int R>
+u8& CPU::reg() {
+    if constexpr (R == 0) return B;
+    else if constexpr (R == 1) return C;
+    else if constexpr (R == 2) return D;
+    else if constexpr (R == 3) return E;
+    else if constexpr (R == 4) return H;
+    else if constexpr (R == 5) return L;
+    else return A;
+}
+
+template <int R>
+u8 CPU::read_reg() {
+    if constexpr (R == 6)
+        return gb->mmu.read_byte(HL.get());
+    else
+        return reg<R>();
+}
+
+template <int R>
+void CPU::write_reg(u8 value) {
+    if constexpr (R == 6)
+        gb->mmu.write_byte(HL.get(), value);
+    else
+        reg<R>() = value;
+}
+
+// BC, DE, HL, AF
+template <int P>
+Register16& CPU::reg_pair() {
+    if constexpr (P == 0) return BC;
+    else if constexpr (P == 1) return DE;
+    else if constexpr (P == 2) return HL;
+    else return AF;
+}
+
+// NZ, Z, NC, C
+template <int CC>
+bool CPU::condition() {
+    if constexpr (CC == 0) return !get_zero();
+    else if constexpr (CC == 1) return get_zero();
+    else if constexpr (CC == 2) return !get_carry();
+    else return get_carry();
+}
+
+// Same operations as execute_ALU_opcode, with the operation fixed
+template <int Y>
+void CPU::alu(u8 value) {
+    int result;
+
+    if constexpr (Y == 0) { // ADD
+        result = A + value;
+        set_flags_lazy(FlagOp::Add, A, value, result, false);
+        A = result & 0xFF;
+    } else if constexpr (Y == 1) { // ADC
+        bool carry = get_carry();
+        result = A + value + carry;
+        set_flags_lazy(FlagOp::Adc, A, value, result, carry);
+        A = result & 0xFF;
+    } else if constexpr (Y == 2) { // SUB
+        result = A - value;
+        set_flags_lazy(FlagOp::Sub, A, value, result, false);
+        A = result & 0xFF;
+    } else if constexpr (Y == 3) { // SBC
+        bool carry = get_carry();
+        result = A - value - carry;
+        set_flags_lazy(FlagOp::Sbc, A, value, result, carry);
+        A = result & 0xFF;
+    } else if constexpr (Y == 4) { // AND
+        A &= value;
+        set_flags_lazy(FlagOp::And, 0, 0, A, false);
+    } else if constexpr (Y == 5) { // XOR
+        A ^= value;
+        set_flags_lazy(FlagOp::Or, 0, 0, A, false);
+    } else if constexpr (Y == 6) { // OR
+        A |= value;
+        set_flags_lazy(FlagOp::Or, 0, 0, A, false);
+    } else { // CP
+        result = A - value;
+        set_flags_lazy(FlagOp::Sub, A, value, result, false);
+    }
+}
+
+// Handler for a single opcode. The x/y/z/p/q decoding from decode_opcode()
+// is done at compile time, so every instantiation only contains the code
+// for its own instruction.
+template <int OP>
+void CPU::op() {
+    constexpr int x = OP >> 6;
+    constexpr int y = (OP >> 3) & 0x7;
+    constexpr int z = OP & 0x7;
+    constexpr int p = y >> 1;
+    constexpr int q = y & 0x1;
+
+    int result;
+
+    if constexpr (x == 0) {
+        if constexpr (z == 0) {
+            if constexpr (y == 1) { // LD (a16), SP
+                gb->mmu.write_word(immediate16(), SP);
+            } else if constexpr (y == 3) { // JR r8
+                result = immediate8();
+                if (result >= 128)
+                    result -= 256;
+                PC += result;
+            } else if constexpr (y >= 4) { // JR cc[y-4], r8
+                if (condition<y - 4>()) {
+                    result = immediate8();
+                    if (result >= 128)
+                        result -= 256;
+                    PC += result;
+                    elapsed_cycles += 4;
+                }
+            }
+            // NOP and STOP 0 do nothing
+        } else if constexpr (z == 1) {
+            if constexpr (q == 0) { // LD rp[p], d16
+                if constexpr (p < 3)
+                    reg_pair<p>().set(immediate16());
+                else
+                    SP = immediate16();
+            } else { // ADD HL, rp[p]
+                u16 prev = HL.get();
+                if constexpr (p < 3)
+                    result = prev + reg_pair<p>().get();
+                else
+                    result = prev + SP;
+                set_subtract(false);
+                set_half_carry((result & 0xFFF) < (prev & 0xFFF));
+                set_carry(result > 0xFFFF);
+                HL.set(result & 0xFFFF);
+            }
+        } else if constexpr (z == 2) {
+            // LD (BC),A  LD (DE),A  LD (HL+),A  LD (HL-),A
+            // LD A,(BC)  LD A,(DE)  LD A,(HL+)  LD A,(HL-)
+            constexpr int pair = p < 2 ? p : 2;
+            if constexpr (q == 0)
+                gb->mmu.write_byte(reg_pair<pair>().get(), A);
+            else
+                A = gb->mmu.read_byte(reg_pair<pair>().get());
+
+            if constexpr (p == 2)
+                HL.set(HL.get() + 1);
+            else if constexpr (p == 3)
+                HL.set(HL.get() - 1);
+        } else if constexpr (z == 3) {
+            if constexpr (q == 0) { // INC rp[p]
+                if constexpr (p < 3)
+                    reg_pair<p>().set(reg_pair<p>().get() + 1);
+                else
+                    SP++;
+            } else { // DEC rp[p]
+                if constexpr (p < 3)
+                    reg_pair<p>().set(reg_pair<p>().get() - 1);
+                else
+                    SP--;
+            }
+        } else if constexpr (z == 4) { // INC r[y]
+            u8 prev = read_reg<y>();
+            result = prev + 1;
+            write_reg<y>(result & 0xFF);
+            set_flags_lazy(FlagOp::Inc, prev, 0, result, get_carry());
+        } else if constexpr (z == 5) { // DEC r[y]
+            u8 prev = read_reg<y>();
+            result = prev - 1;
+            write_reg<y>(result & 0xFF);
+            set_flags_lazy(FlagOp::Dec, prev, 0, result, get_carry());
+        } else if constexpr (z == 6) { // LD r[y],d8
+            write_reg<y>(immediate8());
+        } else {
+            if constexpr (y == 0) { // RLCA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                set_carry(A >> 7);
+                A = (A << 1) | (A >> 7);
+            } else if constexpr (y == 1) { // RRCA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                set_carry(A & 0x1);
+                A = (A >> 1) | ((A & 0x1) << 7);
+            } else if constexpr (y == 2) { // RLA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                result = A << 1 | get_carry();
+                set_carry(A >> 7);
+                A = result & 0xFF;
+            } else if constexpr (y == 3) { // RRA
+                set_zero(false); set_subtract(false); set_half_carry(false);
+                result = A >> 1 | get_carry() << 7;
+                set_carry(A & 0x1);
+                A = result & 0xFF;
+            } else if constexpr (y == 4) { // DAA
+                int a = A;
+                if (!get_subtract()) {
+                    if (get_half_carry() || (a & 0xF) > 9)
+                        a += 0x06;
+                    if (get_carry() || a > 0x9F)
+                        a += 0x60;
+                } else {
+                    if (get_half_carry())
+                        a = (a - 6) & 0xFF;
+                    if (get_carry())
+                        a -= 0x60;
+                }
+
+                set_half_carry(false);
+
+                if ((a & 0x100) == 0x100)
+                    set_carry(true);
+
+                A = a & 0xFF;
+                set_zero(A == 0);
+            } else if constexpr (y == 5) { // CPL
+                A = ~A;
+                set_subtract(true);
+                set_half_carry(true);
+            } else if constexpr (y == 6) { // SCF
+                set_subtract(false);
+                set_half_carry(false);
+                set_carry(true);
+            } else { // CCF
+                set_subtract(false);
+                set_half_carry(false);
+                set_carry(!get_carry());
+            }
+        }
+    } else if constexpr (x == 1) {
+        if constexpr (y == 6 && z == 6) // HALT
+            halted = true;
+        else // LD r[y], r[z]
+            write_reg<y>(read_reg<z>());
+    } else if constexpr (x == 2) { // ALU[y] r[z]
+        alu<y>(read_reg<z>());
+    } else {
+        if constexpr (z == 0) {
+            if constexpr (y < 4) { // RET cc[y]
+                if (condition<y>()) {
+                    PC = pop_from_stack() - 1;
+                    elapsed_cycles += 12;
+                }
+            } else if constexpr (y == 4) { // LDH (a8),A
+                gb->mmu.write_byte(0xFF00 + immediate8(), A);
+            } else if constexpr (y == 6) { // LDH A,(a8)
+                A = gb->mmu.read_byte(0xFF00 + immediate8());
+            } else { // ADD SP,r8 and LD HL,SP+r8
+                result = immediate8();
+
+                // Calculate two's complement of the byte
+                if (result >= 128)
+                    result -= 256;
+
+                result = SP + result;
+
+                set_zero(false);
+                set_subtract(false);
+                // Half carry if there is a carry from bit 3 to 4
+                set_half_carry((result & 0x000F) < (SP & 0x000F));
+                // Carry if there is a carry from bit 11 to 12
+                set_carry((result & 0x00FF) < (SP & 0x00FF));
+
+                if constexpr (y == 5)
+                    SP = result & 0xFFFF;
+                else
+                    HL.set(result & 0xFFFF);
+            }
+        } else if constexpr (z == 1) {
+            if constexpr (q == 0) { // POP rp2[p]
+                reg_pair<p>().set(pop_from_stack());
+
+                // When popping AF, the unused lower 4 bits of F can be set
+                // so set those all to zero
+                if constexpr (p == 3) {
+                    F &= 0xF0;
+                    flag_op = FlagOp::None;
+                }
+            } else if constexpr (p == 0) { // RET
+                PC = pop_from_stack() - 1;
+            } else if constexpr (p == 1) { // RETI
+                gb->interrupt_master_enable = true;
+                PC = pop_from_stack() - 1;
+            } else if constexpr (p == 2) { // JP (HL)
+                PC = HL.get() - 1;
+            } else { // LD SP,HL
+                SP = HL.get();
+            }
+        } else if constexpr (z == 2) {
+            if constexpr (y < 4) { // JP cc[y],nn
+                if (condition<y>()) {
+                    PC = immediate16() - 3;
+                    elapsed_cycles += 4;
+                }
+            } else if constexpr (y == 4) { // LD (FF00+C), A
+                gb->mmu.write_byte(0xFF00 + C, A);
+            } else if constexpr (y == 5) { // LD (a16), A
+                gb->mmu.write_byte(immediate16(), A);
+            } else if constexpr (y == 6) { // LD A, (FF00+C)
+                A = gb->mmu.read_byte(0xFF00 + C);
+            } else { // LD A, (a16)
+                A = gb->mmu.read_byte(immediate16());
+            }
+        } else if constexpr (z == 3) {
+            if constexpr (y == 0) { // JP nn
+                PC = immediate16() - 3;
+            } else if constexpr (y == 1) { // CB PREFIX
+                (this->*cb_opcode_table[immediate8()])();
+
+                // Every CB instruction is length 2
+                PC += 1;
+                elapsed_cycles += 8;
+            } else if constexpr (y == 6) { // DI
+                gb->interrupt_master_enable = false;
+            } else if constexpr (y == 7) { // EI
+                gb->interrupt_master_enable = true;
+            }
+        } else if constexpr (z == 4) { // CALL cc[y],nn
+            if constexpr (y < 4) {
+                if (condition<y>()) {
+                    push_to_stack(PC + 3);
+                    PC = immediate16() - 3;
+                    elapsed_cycles += 12;
+                }
+            }
+        } else if constexpr (z == 5) {
+            if constexpr (q == 0) { // PUSH rp2[p]
+                if constexpr (p == 3)
+                    materialize_flags();
+                push_to_stack(reg_pair<p>().get());
+            } else if constexpr (p == 0) { // CALL nn
+                push_to_stack(PC + 3);
+                PC = immediate16() - 3;
+            }
+        } else if constexpr (z == 6) { // alu[y] n
+            alu<y>(immediate8());
+        } else { // RST y*8
+            push_to_stack(PC + 1);
+            PC = y * 8 - 1;
+        }
+    }
+}
+
+// Handler for a single CB-prefixed opcode, see execute_CB_opcode()
+template <int OP>
+void CPU::cb_op() {
+    constexpr int x = OP >> 6;
+    constexpr int y = (OP >> 3) & 0x7;
+    constexpr int z = OP & 0x7;
+
+    u8 value = read_reg<z>();
+    u8 result;
+
+    if constexpr (x == 0) {
+        bool carry;
+        if constexpr (y == 0) { // RLC
+            result = (value << 1) | (value >> 7);
+            carry = value >> 7;
+        } else if constexpr (y == 1) { // RRC
+            result = (value >> 1) | (value << 7);
+            carry = value & 0x1;
+        } else if constexpr (y == 2) { // RL
+            result = (value << 1) | get_carry();
+            carry = value >> 7;
+        } else if constexpr (y == 3) { // RR
+            result = (value >> 1) | (get_carry() << 7);
+            carry = value & 0x1;
+        } else if constexpr (y == 4) { // SLA
+            result = value << 1;
+            carry = value >> 7;
+        } else if constexpr (y == 5) { // SRA
+            result = (value >> 1) | (value & 0b10000000);
+            carry = value & 0x1;
+        } else if constexpr (y == 6) { // SWAP
+            result = (value << 4) | (value >> 4);
+            carry = false;
+        } else { // SRL
+            result = value >> 1;
+            carry = value & 0x1;
         }
+        set_flags_lazy(FlagOp::Shift, 0, 0, result, carry);
+    } else if constexpr (x == 1) { // BIT
+        result = value & (1 << y);
+        set_flags_lazy(FlagOp::Bit, 0, 0, result, get_carry());
+    } else if constexpr (x == 2) { // RES
+        result = value & ~(1 << y);
+    } else { // SET
+        result = value | (1 << y);
+    }
+
+    if constexpr (x != 1)
+        write_reg<z>(result);
+}
 
-        PC += opcode_bytes[opcode];
-        elapsed_cycles += opcode_cycles[opcode];
+const OpcodeHandler CPU::opcode_table[0x100] = {
+    &CPU::op<0x00>, &CPU::op<0x01>, &CPU::op<0x02>, &CPU::op<0x03>, &CPU::op<0x04>, &CPU::op<0x05>, &CPU::op<0x06>, &CPU::op<0x07>, &CPU::op<0x08>, &CPU::op<0x09>, &CPU::op<0x0A>, &CPU::op<0x0B>, &CPU::op<0x0C>, &CPU::op<0x0D>, &CPU::op<0x0E>, &CPU::op<0x0F>,
+    &CPU::op<0x10>, &CPU::op<0x11>, &CPU::op<0x12>, &CPU::op<0x13>, &CPU::op<0x14>, &CPU::op<0x15>, &CPU::op<0x16>, &CPU::op<0x17>, &CPU::op<0x18>, &CPU::op<0x19>, &CPU::op<0x1A>, &CPU::op<0x1B>, &CPU::op<0x1C>, &CPU::op<0x1D>, &CPU::op<0x1E>, &CPU::op<0x1F>,
+    &CPU::op<0x20>, &CPU::op<0x21>, &CPU::op<0x22>, &CPU::op<0x23>, &CPU::op<0x24>, &CPU::op<0x25>, &CPU::op<0x26>, &CPU::op<0x27>, &CPU::op<0x28>, &CPU::op<0x29>, &CPU::op<0x2A>, &CPU::op<0x2B>, &CPU::op<0x2C>, &CPU::op<0x2D>, &CPU::op<0x2E>, &CPU::op<0x2F>,
+    &CPU::op<0x30>, &CPU::op<0x31>, &CPU::op<0x32>, &CPU::op<0x33>, &CPU::op<0x34>, &CPU::op<0x35>, &CPU::op<0x36>, &CPU::op<0x37>, &CPU::op<0x38>, &CPU::op<0x39>, &CPU::op<0x3A>, &CPU::op<0x3B>, &CPU::op<0x3C>, &CPU::op<0x3D>, &CPU::op<0x3E>, &CPU::op<0x3F>,
+
+    &CPU::op<0x40>, &CPU::op<0x41>, &CPU::op<0x42>, &CPU::op<0x43>, &CPU::op<0x44>, &CPU::op<0x45>, &CPU::op<0x46>, &CPU::op<0x47>, &CPU::op<0x48>, &CPU::op<0x49>, &CPU::op<0x4A>, &CPU::op<0x4B>, &CPU::op<0x4C>, &CPU::op<0x4D>, &CPU::op<0x4E>, &CPU::op<0x4F>,
+    &CPU::op<0x50>, &CPU::op<0x51>, &CPU::op<0x52>, &CPU::op<0x53>, &CPU::op<0x54>, &CPU::op<0x55>, &CPU::op<0x56>, &CPU::op<0x57>, &CPU::op<0x58>, &CPU::op<0x59>, &CPU::op<0x5A>, &CPU::op<0x5B>, &CPU::op<0x5C>, &CPU::op<0x5D>, &CPU::op<0x5E>, &CPU::op<0x5F>,
+    &CPU::op<0x60>, &CPU::op<0x61>, &CPU::op<0x62>, &CPU::op<0x63>, &CPU::op<0x64>, &CPU::op<0x65>, &CPU::op<0x66>, &CPU::op<0x67>, &CPU::op<0x68>, &CPU::op<0x69>, &CPU::op<0x6A>, &CPU::op<0x6B>, &CPU::op<0x6C>, &CPU::op<0x6D>, &CPU::op<0x6E>, &CPU::op<0x6F>,
+    &CPU::op<0x70>, &CPU::op<0x71>, &CPU::op<0x72>, &CPU::op<0x73>, &CPU::op<0x74>, &CPU::op<0x75>, &CPU::op<0x76>, &CPU::op<0x77>, &CPU::op<0x78>, &CPU::op<0x79>, &CPU::op<0x7A>, &CPU::op<0x7B>, &CPU::op<0x7C>, &CPU::op<0x7D>, &CPU::op<0x7E>, &CPU::op<0x7F>,
+
+    &CPU::op<0x80>, &CPU::op<0x81>, &CPU::op<0x82>, &CPU::op<0x83>, &CPU::op<0x84>, &CPU::op<0x85>, &CPU::op<0x86>, &CPU::op<0x87>, &CPU::op<0x88>, &CPU::op<0x89>, &CPU::op<0x8A>, &CPU::op<0x8B>, &CPU::op<0x8C>, &CPU::op<0x8D>, &CPU::op<0x8E>, &CPU::op<0x8F>,
+    &CPU::op<0x90>, &CPU::op<0x91>, &CPU::op<0x92>, &CPU::op<0x93>, &CPU::op<0x94>, &CPU::op<0x95>, &CPU::op<0x96>, &CPU::op<0x97>, &CPU::op<0x98>, &CPU::op<0x99>, &CPU::op<0x9A>, &CPU::op<0x9B>, &CPU::op<0x9C>, &CPU::op<0x9D>, &CPU::op<0x9E>, &CPU::op<0x9F>,
+    &CPU::op<0xA0>, &CPU::op<0xA1>, &CPU::op<0xA2>, &CPU::op<0xA3>, &CPU::op<0xA4>, &CPU::op<0xA5>, &CPU::op<0xA6>, &CPU::op<0xA7>, &CPU::op<0xA8>, &CPU::op<0xA9>, &CPU::op<0xAA>, &CPU::op<0xAB>, &CPU::op<0xAC>, &CPU::op<0xAD>, &CPU::op<0xAE>, &CPU::op<0xAF>,
+    &CPU::op<0xB0>, &CPU::op<0xB1>, &CPU::op<0xB2>, &CPU::op<0xB3>, &CPU::op<0xB4>, &CPU::op<0xB5>, &CPU::op<0xB6>, &CPU::op<0xB7>, &CPU::op<0xB8>, &CPU::op<0xB9>, &CPU::op<0xBA>, &CPU::op<0xBB>, &CPU::op<0xBC>, &CPU::op<0xBD>, &CPU::op<0xBE>, &CPU::op<0xBF>,
+
+    &CPU::op<0xC0>, &CPU::op<0xC1>, &CPU::op<0xC2>, &CPU::op<0xC3>, &CPU::op<0xC4>, &CPU::op<0xC5>, &CPU::op<0xC6>, &CPU::op<0xC7>, &CPU::op<0xC8>, &CPU::op<0xC9>, &CPU::op<0xCA>, &CPU::op<0xCB>, &CPU::op<0xCC>, &CPU::op<0xCD>, &CPU::op<0xCE>, &CPU::op<0xCF>,
+    &CPU::op<0xD0>, &CPU::op<0xD1>, &CPU::op<0xD2>, &CPU::op<0xD3>, &CPU::op<0xD4>, &CPU::op<0xD5>, &CPU::op<0xD6>, &CPU::op<0xD7>, &CPU::op<0xD8>, &CPU::op<0xD9>, &CPU::op<0xDA>, &CPU::op<0xDB>, &CPU::op<0xDC>, &CPU::op<0xDD>, &CPU::op<0xDE>, &CPU::op<0xDF>,
+    &CPU::op<0xE0>, &CPU::op<0xE1>, &CPU::op<0xE2>, &CPU::op<0xE3>, &CPU::op<0xE4>, &CPU::op<0xE5>, &CPU::op<0xE6>, &CPU::op<0xE7>, &CPU::op<0xE8>, &CPU::op<0xE9>, &CPU::op<0xEA>, &CPU::op<0xEB>, &CPU::op<0xEC>, &CPU::op<0xED>, &CPU::op<0xEE>, &CPU::op<0xEF>,
+    &CPU::op<0xF0>, &CPU::op<0xF1>, &CPU::op<0xF2>, &CPU::op<0xF3>, &CPU::op<0xF4>, &CPU::op<0xF5>, &CPU::op<0xF6>, &CPU::op<0xF7>, &CPU::op<0xF8>, &CPU::op<0xF9>, &CPU::op<0xFA>, &CPU::op<0xFB>, &CPU::op<0xFC>, &CPU::op<0xFD>, &CPU::op<0xFE>, &CPU::op<0xFF>,
+};
+
+const OpcodeHandler CPU::cb_opcode_table[0x100] = {
+    &CPU::cb_op<0x00>, &CPU::cb_op<0x01>, &CPU::cb_op<0x02>, &CPU::cb_op<0x03>, &CPU::cb_op<0x04>, &CPU::cb_op<0x05>, &CPU::cb_op<0x06>, &CPU::cb_op<0x07>, &CPU::cb_op<0x08>, &CPU::cb_op<0x09>, &CPU::cb_op<0x0A>, &CPU::cb_op<0x0B>, &CPU::cb_op<0x0C>, &CPU::cb_op<0x0D>, &CPU::cb_op<0x0E>, &CPU::cb_op<0x0F>,
+    &CPU::cb_op<0x10>, &CPU::cb_op<0x11>, &CPU::cb_op<0x12>, &CPU::cb_op<0x13>, &CPU::cb_op<0x14>, &CPU::cb_op<0x15>, &CPU::cb_op<0x16>, &CPU::cb_op<0x17>, &CPU::cb_op<0x18>, &CPU::cb_op<0x19>, &CPU::cb_op<0x1A>, &CPU::cb_op<0x1B>, &CPU::cb_op<0x1C>, &CPU::cb_op<0x1D>, &CPU::cb_op<0x1E>, &CPU::cb_op<0x1F>,
+    &CPU::cb_op<0x20>, &CPU::cb_op<0x21>, &CPU::cb_op<0x22>, &CPU::cb_op<0x23>, &CPU::cb_op<0x24>, &CPU::cb_op<0x25>, &CPU::cb_op<0x26>, &CPU::cb_op<0x27>, &CPU::cb_op<0x28>, &CPU::cb_op<0x29>, &CPU::cb_op<0x2A>, &CPU::cb_op<0x2B>, &CPU::cb_op<0x2C>, &CPU::cb_op<0x2D>, &CPU::cb_op<0x2E>, &CPU::cb_op<0x2F>,
+    &CPU::cb_op<0x30>, &CPU::cb_op<0x31>, &CPU::cb_op<0x32>, &CPU::cb_op<0x33>, &CPU::cb_op<0x34>, &CPU::cb_op<0x35>, &CPU::cb_op<0x36>, &CPU::cb_op<0x37>, &CPU::cb_op<0x38>, &CPU::cb_op<0x39>, &CPU::cb_op<0x3A>, &CPU::cb_op<0x3B>, &CPU::cb_op<0x3C>, &CPU::cb_op<0x3D>, &CPU::cb_op<0x3E>, &CPU::cb_op<0x3F>,
+
+    &CPU::cb_op<0x40>, &CPU::cb_op<0x41>, &CPU::cb_op<0x42>, &CPU::cb_op<0x43>, &CPU::cb_op<0x44>, &CPU::cb_op<0x45>, &CPU::cb_op<0x46>, &CPU::cb_op<0x47>, &CPU::cb_op<0x48>, &CPU::cb_op<0x49>, &CPU::cb_op<0x4A>, &CPU::cb_op<0x4B>, &CPU::cb_op<0x4C>, &CPU::cb_op<0x4D>, &CPU::cb_op<0x4E>, &CPU::cb_op<0x4F>,
+    &CPU::cb_op<0x50>, &CPU::cb_op<0x51>, &CPU::cb_op<0x52>, &CPU::cb_op<0x53>, &CPU::cb_op<0x54>, &CPU::cb_op<0x55>, &CPU::cb_op<0x56>, &CPU::cb_op<0x57>, &CPU::cb_op<0x58>, &CPU::cb_op<0x59>, &CPU::cb_op<0x5A>, &CPU::cb_op<0x5B>, &CPU::cb_op<0x5C>, &CPU::cb_op<0x5D>, &CPU::cb_op<0x5E>, &CPU::cb_op<0x5F>,
+    &CPU::cb_op<0x60>, &CPU::cb_op<0x61>, &CPU::cb_op<0x62>, &CPU::cb_op<0x63>, &CPU::cb_op<0x64>, &CPU::cb_op<0x65>, &CPU::cb_op<0x66>, &CPU::cb_op<0x67>, &CPU::cb_op<0x68>, &CPU::cb_op<0x69>, &CPU::cb_op<0x6A>, &CPU::cb_op<0x6B>, &CPU::cb_op<0x6C>, &CPU::cb_op<0x6D>, &CPU::cb_op<0x6E>, &CPU::cb_op<0x6F>,
+    &CPU::cb_op<0x70>, &CPU::cb_op<0x71>, &CPU::cb_op<0x72>, &CPU::cb_op<0x73>, &CPU::cb_op<0x74>, &CPU::cb_op<0x75>, &CPU::cb_op<0x76>, &CPU::cb_op<0x77>, &CPU::cb_op<0x78>, &CPU::cb_op<0x79>, &CPU::cb_op<0x7A>, &CPU::cb_op<0x7B>, &CPU::cb_op<0x7C>, &CPU::cb_op<0x7D>, &CPU::cb_op<0x7E>, &CPU::cb_op<0x7F>,
+
+    &CPU::cb_op<0x80>, &CPU::cb_op<0x81>, &CPU::cb_op<0x82>, &CPU::cb_op<0x83>, &CPU::cb_op<0x84>, &CPU::cb_op<0x85>, &CPU::cb_op<0x86>, &CPU::cb_op<0x87>, &CPU::cb_op<0x88>, &CPU::cb_op<0x89>, &CPU::cb_op<0x8A>, &CPU::cb_op<0x8B>, &CPU::cb_op<0x8C>, &CPU::cb_op<0x8D>, &CPU::cb_op<0x8E>, &CPU::cb_op<0x8F>,
+    &CPU::cb_op<0x90>, &CPU::cb_op<0x91>, &CPU::cb_op<0x92>, &CPU::cb_op<0x93>, &CPU::cb_op<0x94>, &CPU::cb_op<0x95>, &CPU::cb_op<0x96>, &CPU::cb_op<0x97>, &CPU::cb_op<0x98>, &CPU::cb_op<0x99>, &CPU::cb_op<0x9A>, &CPU::cb_op<0x9B>, &CPU::cb_op<0x9C>, &CPU::cb_op<0x9D>, &CPU::cb_op<0x9E>, &CPU::cb_op<0x9F>,
+    &CPU::cb_op<0xA0>, &CPU::cb_op<0xA1>, &CPU::cb_op<0xA2>, &CPU::cb_op<0xA3>, &CPU::cb_op<0xA4>, &CPU::cb_op<0xA5>, &CPU::cb_op<0xA6>, &CPU::cb_op<0xA7>, &CPU::cb_op<0xA8>, &CPU::cb_op<0xA9>, &CPU::cb_op<0xAA>, &CPU::cb_op<0xAB>, &CPU::cb_op<0xAC>, &CPU::cb_op<0xAD>, &CPU::cb_op<0xAE>, &CPU::cb_op<0xAF>,
+    &CPU::cb_op<0xB0>, &CPU::cb_op<0xB1>, &CPU::cb_op<0xB2>, &CPU::cb_op<0xB3>, &CPU::cb_op<0xB4>, &CPU::cb_op<0xB5>, &CPU::cb_op<0xB6>, &CPU::cb_op<0xB7>, &CPU::cb_op<0xB8>, &CPU::cb_op<0xB9>, &CPU::cb_op<0xBA>, &CPU::cb_op<0xBB>, &CPU::cb_op<0xBC>, &CPU::cb_op<0xBD>, &CPU::cb_op<0xBE>, &CPU::cb_op<0xBF>,
+
+    &CPU::cb_op<0xC0>, &CPU::cb_op<0xC1>, &CPU::cb_op<0xC2>, &CPU::cb_op<0xC3>, &CPU::cb_op<0xC4>, &CPU::cb_op<0xC5>, &CPU::cb_op<0xC6>, &CPU::cb_op<0xC7>, &CPU::cb_op<0xC8>, &CPU::cb_op<0xC9>, &CPU::cb_op<0xCA>, &CPU::cb_op<0xCB>, &CPU::cb_op<0xCC>, &CPU::cb_op<0xCD>, &CPU::cb_op<0xCE>, &CPU::cb_op<0xCF>,
+    &CPU::cb_op<0xD0>, &CPU::cb_op<0xD1>, &CPU::cb_op<0xD2>, &CPU::cb_op<0xD3>, &CPU::cb_op<0xD4>, &CPU::cb_op<0xD5>, &CPU::cb_op<0xD6>, &CPU::cb_op<0xD7>, &CPU::cb_op<0xD8>, &CPU::cb_op<0xD9>, &CPU::cb_op<0xDA>, &CPU::cb_op<0xDB>, &CPU::cb_op<0xDC>, &CPU::cb_op<0xDD>, &CPU::cb_op<0xDE>, &CPU::cb_op<0xDF>,
+    &CPU::cb_op<0xE0>, &CPU::cb_op<0xE1>, &CPU::cb_op<0xE2>, &CPU::cb_op<0xE3>, &CPU::cb_op<0xE4>, &CPU::cb_op<0xE5>, &CPU::cb_op<0xE6>, &CPU::cb_op<0xE7>, &CPU::cb_op<0xE8>, &CPU::cb_op<0xE9>, &CPU::cb_op<0xEA>, &CPU::cb_op<0xEB>, &CPU::cb_op<0xEC>, &CPU::cb_op<0xED>, &CPU::cb_op<0xEE>, &CPU::cb_op<0xEF>,
+    &CPU::cb_op<0xF0>, &CPU::cb_op<0xF1>, &CPU::cb_op<0xF2>, &CPU::cb_op<0xF3>, &CPU::cb_op<0xF4>, &CPU::cb_op<0xF5>, &CPU::cb_op<0xF6>, &CPU::cb_op<0xF7>, &CPU::cb_op<0xF8>, &CPU::cb_op<0xF9>, &CPU::cb_op<0xFA>, &CPU::cb_op<0xFB>, &CPU::cb_op<0xFC>, &CPU::cb_op<0xFD>, &CPU::cb_op<0xFE>, &CPU::cb_op<0xFF>,
+};
+
+void CPU::execute_opcode() {
+    if (gb->debug_mode) {
+        debug_print();
+    }
+
+    elapsed_cycles = 0;
+
+    if (!halted) {
+        // Run the translated code of the block at PC, if there is any
+        if (dynarec.enabled && !gb->debug_mode) {
+            int native_cycles = dynarec.execute();
+            if (native_cycles > 0) {
+                elapsed_cycles = native_cycles;
+                cycles += elapsed_cycles;
+                return;
+            }
+        }
+
+        // Copied, since the instruction can overwrite its own cached block
+        DecodedInstruction instruction = *block_cache.fetch(PC);
+        operand = instruction.operand;
+
+#ifdef CPU_SWITCH_DECODER
+        decode_opcode(instruction.opcode);
+#else
+        (this->*opcode_table[instruction.opcode])();
+#endif
+
+        PC += instruction.length;
+        elapsed_cycles += instruction.cycles;
         cycles += elapsed_cycles;
+
+        // A jump back to at most MAX_IDLE_LOOP_BYTES before it
+        if (skip_idle_loops && PC <= instruction.address &&
+            instruction.address - PC < MAX_IDLE_LOOP_BYTES)
+            skip_idle_loop();
     } else {
-        //std::cout << "halted -> dont execute anything" << std::endl;
-        elapsed_cycles += 4;
+        // Nothing can happen until an interrupt is requested, so skip ahead
+        // to the next cycle where the timer, GPU or APU changes state
+        elapsed_cycles += std::max(gb->cycles_until_event() & ~3, 4);
         cycles += elapsed_cycles;
+        gb->stats.halted_cycles_skipped += elapsed_cycles - 4;
     }
 }
\ No newline at end of file
@@ -1,29 +1,50 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include "blockcache.h"
 #include "def.h"
+#include "dynarec.h"
 
 class GameBoy;
+class CPU;
 
-class Register16 {
-public:
-    Register16();
-    Register16(u8* upper, u8* lower);
+// Instruction lengths and base cycle counts, indexed by opcode
+extern const int opcode_bytes[0x100];
+extern const int opcode_cycles[0x100];
 
-    u16 get();
-    void set(u16 value);
+// Pointer to one of the per-opcode handlers in the dispatch tables
+typedef void (CPU::*OpcodeHandler)();
 
-private:
-    u8* upper;
-    u8* lower;
+// The last operation that set the flags, see CPU::materialize_flags()
+namespace FlagOp {
+    enum Type {None, Add, Adc, Sub, Sbc, And, Or, Inc, Dec, Shift, Bit};
+}
+
+// A register pair like BC. It shares its storage with the two 8-bit
+// registers in CPU, so get() and set() are plain 16-bit accesses.
+struct Register16 {
+    u16 get() const { return value; }
+    void set(u16 new_value) { value = new_value; }
+
+    u16 value;
 };
 
+// The 8-bit halves of a register pair in host byte order
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REGISTER_PAIR(pair, upper, lower) \
+    union { Register16 pair; struct { u8 upper, lower; }; }
+#else
+#define REGISTER_PAIR(pair, upper, lower) \
+    union { Register16 pair; struct { u8 lower, upper; }; }
+#endif
+
 class CPU {
 public:
     CPU(GameBoy* gb);
     ~CPU();
 
     void set_flag(int flag, bool value);
+    void materialize_flags();
 
     bool get_zero();
     void set_zero(bool value);
@@ -44,16 +65,62 @@ public:
 
     void handle_interrupt(u16 handler_address);
 
+    int skip_idle_loop();
+
     u8 current_opcode();
 
     void debug_print();
     
     void execute_ALU_opcode(u8 opcode, bool immediate);
     void execute_CB_opcode(u8 opcode);
+    void decode_opcode(u8 opcode);
 
     void execute_opcode();
 
+private:
+    // Table-driven dispatch: every opcode gets its own specialized handler,
+    // generated from the templates below, so decoding is a single lookup.
+    // Build with -DCPU_SWITCH_DECODER to use decode_opcode() instead.
+    static const OpcodeHandler opcode_table[0x100];
+    static const OpcodeHandler cb_opcode_table[0x100];
+
+    // Operands of the current instruction, taken from the block cache
+    u8 immediate8() { return operand & 0xFF; }
+    u16 immediate16() { return operand; }
+
+    // Flag-setting operations only store their operands and result, the
+    // flags are computed when they are read. Build with -DCPU_EAGER_FLAGS
+    // to update F right away instead.
+    void set_flags_lazy(FlagOp::Type op, int a, int b, int result, bool carry) {
+        flag_op = op;
+        flag_a = a;
+        flag_b = b;
+        flag_result = result;
+        flag_carry = carry;
+#ifdef CPU_EAGER_FLAGS
+        materialize_flags();
+#endif
+    }
+
+    template <int R> u8& reg();
+    template <int R> u8 read_reg();
+    template <int R> void write_reg(u8 value);
+    template <int P> Register16& reg_pair();
+    template <int CC> bool condition();
+
+    template <int Y> void alu(u8 value);
+    template <int OP> void op();
+    template <int OP> void cb_op();
+
 public:
+    // The register file is kept together at the start of the CPU
+    REGISTER_PAIR(AF, A, F);
+    REGISTER_PAIR(BC, B, C);
+    REGISTER_PAIR(DE, D, E);
+    REGISTER_PAIR(HL, H, L);
+    u16 PC;
+    u16 SP;
+
     GameBoy* gb;
 
     bool tracking;
@@ -64,13 +131,25 @@ public:
 
     bool halted;
 
-    u8 A, F;
-    u8 B, C;
-    u8 D, E;
-    u8 H, L;
-    Register16 AF, BC, DE, HL;
-    u16 PC;
-    u16 SP;
+    // Idle loop skipping, see skip_idle_loop(). Disabled by default.
+    bool skip_idle_loops;
+    u16 idle_loop_start;
+    u16 idle_loop_registers[5];
+    unsigned int idle_loop_cycles;
+    unsigned int idle_loop_event;
+    unsigned int idle_loop_writes;
+
+    BlockCache block_cache;
+    Dynarec dynarec;
+    u16 operand;
+
+    // Pending flags, F is out of date unless flag_op is FlagOp::None.
+    // flag_carry is the carry in for ADC/SBC, the carry out for shifts and
+    // the unchanged carry for INC/DEC/BIT.
+    FlagOp::Type flag_op;
+    int flag_a, flag_b;
+    int flag_result;
+    bool flag_carry;
 
     bool debug_printing;
 };
@@ -11,14 +11,22 @@ Debug::Debug(GameBoy* gb, SDL_Renderer* renderer) : m_gb(gb) , m_renderer(render
     m_font = FC_CreateFont();
     FC_LoadFont(m_font, m_renderer, "monogram.ttf", 32, FC_MakeColor(255, 255, 255, 255), TTF_STYLE_NORMAL);
     current_fps = 0;
+
+    // 16x24 tiles of 8x8 pixels and a 1024x8 audio waveform, updated every
+    // frame
+    m_tiles_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 16*8, 24*8);
+    m_waveform_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, 1024, 8);
 }
 
 Debug::~Debug() {
+    SDL_DestroyTexture(m_tiles_texture);
+    SDL_DestroyTexture(m_waveform_texture);
     FC_FreeFont(m_font);
 }
 
 void Debug::draw(int x, int y) {
     // CPU
+    m_gb->cpu.materialize_flags();
     FC_Draw(m_font, m_renderer, x + 20, 20, fmt::format("PC={0:04X} SP={1:04X}", m_gb->cpu.PC, m_gb->cpu.SP).c_str());
     FC_Draw(m_font, m_renderer, x + 20, 40, fmt::format("AF={0:04X} BC={1:04X}", m_gb->cpu.AF.get(), m_gb->cpu.BC.get()).c_str());
     FC_Draw(m_font, m_renderer, x + 20, 60, fmt::format("DE={0:04X} HL={1:04X}", m_gb->cpu.DE.get(), m_gb->cpu.HL.get()).c_str());
@@ -28,14 +36,15 @@ void Debug::draw(int x, int y) {
     FC_Draw(m_font, m_renderer, x + 20, 100, fmt::format("IF={0:05b} IE={1:05b} IME={2:b}", m_gb->interrupt_flags, m_gb->interrupt_enable, m_gb->interrupt_master_enable).c_str());
 
     // Timer
-    FC_Draw(m_font, m_renderer, x + 20, 140, fmt::format("DIV={0:2X} TIMA={1:2X} TMA={2:2X} TAC={3:2X}", m_gb->divide_register, m_gb->timer_counter, m_gb->timer_modulo, m_gb->timer_control).c_str());
+    FC_Draw(m_font, m_renderer, x + 20, 140, fmt::format("DIV={0:2X} TIMA={1:2X} TMA={2:2X} TAC={3:2X}", m_gb->divider >> 8, m_gb->timer_counter, m_gb->timer_modulo, m_gb->timer_control).c_str());
 
     FC_Draw(m_font, m_renderer, x + 20, 180, fmt::format("STAT={0:08b}", m_gb->gpu.lcd_status).c_str());
 
     FC_Draw(m_font, m_renderer, x + 20, 200, fmt::format("FPS: {}", current_fps).c_str());
 
 
-    // Audio
+    // Audio, the APU only catches up with the CPU when it is accessed
+    m_gb->apu.update();
     int ch1_freq = ((m_gb->apu.NR14 & 0b111) << 8) | m_gb->apu.NR13;
     int ch2_freq = ((m_gb->apu.NR24 & 0b111) << 8) | m_gb->apu.NR23;
     FC_Draw(m_font, m_renderer, x + 20, 220, fmt::format("F1={} F2={}", ch1_freq, ch2_freq).c_str());
@@ -48,6 +57,7 @@ void Debug::draw(int x, int y) {
 
     // Convert the gameboy tiledata of a series of 64 values to an array
     // that we can draw on the screen
+    m_gb->gpu.decode_tiles();
     for (int tile_x = 0; tile_x < 16; tile_x++) {
         for (int tile_y = 0; tile_y < 24; tile_y++) {
             for (int pixel = 0; pixel < 8*8; pixel++) {
@@ -59,25 +69,12 @@ void Debug::draw(int x, int y) {
         }
     }
 
-    // 16x24 tiles of 8x8 pixels
-    SDL_Surface* screen = SDL_CreateRGBSurfaceFrom(
-        &conv[0],
-        16*8, // width
-        24*8, // height
-        32, // bits per pixel
-        16*8*4, // bytes per row of pixels
-        0xFF000000,
-        0x00FF0000,
-        0x0000FF00,
-        0x000000FF);
-
-    SDL_Texture* texture = SDL_CreateTextureFromSurface(m_renderer, screen);
-    SDL_FreeSurface(screen);
+    // 16x24 tiles of 8x8 pixels, 16*8*4 bytes per row of pixels
+    SDL_UpdateTexture(m_tiles_texture, NULL, &conv[0], 16*8*4);
 
     // Render the gameboy texture onto the screen
     SDL_Rect dst = {x + 400, 20, 16*8*2, 24*8*2};
-    SDL_RenderCopy(m_renderer, texture, NULL, &dst);
-    SDL_DestroyTexture(texture);
+    SDL_RenderCopy(m_renderer, m_tiles_texture, NULL, &dst);
 
 
     // Audio waveforms
@@ -94,23 +91,10 @@ void Debug::draw(int x, int y) {
         img[value*1024 + sample] = palette[0];
     }
 
-    // 16x24 tiles of 8x8 pixels
-    screen = SDL_CreateRGBSurfaceFrom(
-        &img[0],
-        1024, // width
-        8, // height
-        32, // bits per pixel
-        1024*4, // bytes per row of pixels
-        0xFF000000,
-        0x00FF0000,
-        0x0000FF00,
-        0x000000FF);
-
-    texture = SDL_CreateTextureFromSurface(m_renderer, screen);
-    SDL_FreeSurface(screen);
+    // 1024*4 bytes per row of pixels
+    SDL_UpdateTexture(m_waveform_texture, NULL, &img[0], 1024*4);
 
     // Render the gameboy texture onto the screen
     dst = {x + 20, 450, 512, 32};
-    SDL_RenderCopy(m_renderer, texture, NULL, &dst);
-    SDL_DestroyTexture(texture);
+    SDL_RenderCopy(m_renderer, m_waveform_texture, NULL, &dst);
 }
\ No newline at end of file
@@ -18,6 +18,8 @@ public:
     GameBoy* m_gb;
     SDL_Renderer* m_renderer;
     FC_Font* m_font;
+    SDL_Texture* m_tiles_texture;
+    SDL_Texture* m_waveform_texture;
     int current_fps;
 };
 
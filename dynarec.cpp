@@ -0,0 +1,595 @@
+#include "dynarec.h"
+
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "gameboy.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DYNAREC_X64
+#endif
+
+// A block is translated after it has been entered this many times
+const int HOT_BLOCK_EXECUTIONS = 32;
+
+// Cycles of the instructions in a single translation, this only bounds the
+// size of the code. The run itself also ends at the next scheduled event.
+const int MAX_NATIVE_CYCLES = 64;
+
+const std::size_t CODE_BUFFER_SIZE = 4 * 1024 * 1024;
+
+// x86-64 registers, as used in the ModRM byte
+const int EAX = 0;
+const int ECX = 1;
+const int EDX = 2;
+
+// Memory accesses of translated code. These return -1 when the access
+// has to be left to the interpreter.
+static int native_read(CPU* cpu, int address) {
+    if (address >= 0xFF00 && address < 0xFF80)
+        return -1;
+
+    return cpu->gb->mmu.read_byte(address);
+}
+
+static int native_write(CPU* cpu, int address, int value) {
+    if (address < 0x8000 || (address >= 0xFF00 && address < 0xFF80) || address == 0xFFFF)
+        return -1;
+
+    cpu->gb->mmu.write_byte(address, value);
+    return 0;
+}
+
+Dynarec::Dynarec(GameBoy* gb) : gb(gb) {
+    enabled = false;
+
+    code_buffer = NULL;
+    code_used = 0;
+    exit_result = 0;
+    cycle_budget = 0;
+
+#ifdef DYNAREC_X64
+#if defined(_WIN32)
+    code_buffer = (u8*)VirtualAlloc(NULL, CODE_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    void* memory = mmap(NULL, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED)
+        code_buffer = (u8*)memory;
+#endif
+#endif
+}
+
+Dynarec::~Dynarec() {
+    if (code_buffer == NULL)
+        return;
+
+#if defined(_WIN32)
+    VirtualFree(code_buffer, 0, MEM_RELEASE);
+#else
+    munmap(code_buffer, CODE_BUFFER_SIZE);
+#endif
+}
+
+// Runs the translated code for the block at PC. Returns the number of cycles
+// that were executed, or 0 if the interpreter should execute the instruction.
+int Dynarec::execute() {
+    CPU& cpu = gb->cpu;
+    BlockCache& cache = cpu.block_cache;
+
+    // Translated code is only entered at the start of a block
+    if (cache.continues(cpu.PC))
+        return 0;
+
+    // Leaves the cache cursor at the start of the block for the interpreter
+    Block* block = cache.enter(cpu.PC);
+    if (block == NULL || block->start >= 0x8000)
+        return 0;
+
+    if (block->native == NULL) {
+        if (block->untranslatable || ++block->executions < HOT_BLOCK_EXECUTIONS)
+            return 0;
+
+        if (!translate(block))
+            return 0;
+    }
+
+    // Translated code works on F directly
+    cpu.materialize_flags();
+
+    // Stop where the interpreter would update the timers, GPU and APU and
+    // take the interrupts they request. Interrupts requested by writes to
+    // IF or IE already leave the translated code before the write.
+    cycle_budget = gb->cycles_until_event();
+
+    unsigned int result = block->native(&cpu);
+    std::size_t count = result >> 16;
+
+    if (count == 0)
+        return 0;
+
+    // Continue with the rest of the block in the interpreter
+    if (count < block->instructions.size()) {
+        cpu.PC = block->instructions[count].address;
+        cache.current = block;
+        cache.index = count;
+    } else {
+        cpu.PC = block->end;
+        cache.current = NULL;
+    }
+
+    return result & 0xFFFF;
+}
+
+// Throws away all translated code
+void Dynarec::flush() {
+    std::unordered_map<unsigned int, Block>& blocks = gb->cpu.block_cache.blocks;
+
+    for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+        it->second.native = NULL;
+        it->second.executions = 0;
+    }
+
+    code_used = 0;
+}
+
+bool Dynarec::translate(Block* block) {
+#ifdef DYNAREC_X64
+    if (code_buffer == NULL || gb->disable_bios == 0) {
+        block->untranslatable = true;
+        return false;
+    }
+
+    code.clear();
+
+    // Prologue, keep the CPU pointer in rbx
+    emit(0x53); // push rbx
+#if defined(_WIN32)
+    emit(0x48); emit(0x89); emit(0xCB); // mov rbx, rcx
+    emit(0x48); emit(0x83); emit(0xEC); emit(0x20); // sub rsp, 32
+#else
+    emit(0x48); emit(0x89); emit(0xFB); // mov rbx, rdi
+#endif
+
+    std::size_t count = 0;
+    int cycles = 0;
+
+    for (; count < block->instructions.size(); count++) {
+        const DecodedInstruction& instruction = block->instructions[count];
+
+        // The handler of the CB prefix adds 8 cycles on top of opcode_cycles
+        int instruction_cycles = instruction.cycles + (instruction.opcode == 0xCB ? 8 : 0);
+        if (cycles + instruction_cycles > MAX_NATIVE_CYCLES)
+            break;
+
+        // Exits inside this instruction report the instructions before it
+        exit_result = (count << 16) | cycles;
+
+        std::size_t start = code.size();
+        if (count > 0)
+            emit_exit_on_deadline(cycles);
+
+        if (!translate_instruction(instruction)) {
+            code.resize(start);
+            break;
+        }
+
+        cycles += instruction_cycles;
+    }
+
+    if (count == 0) {
+        block->untranslatable = true;
+        return false;
+    }
+
+    emit_return((count << 16) | cycles);
+
+    if (code_used + code.size() > CODE_BUFFER_SIZE)
+        flush();
+
+    memcpy(code_buffer + code_used, &code[0], code.size());
+    block->native = (NativeCode)(code_buffer + code_used);
+    code_used += code.size();
+
+    return true;
+#else
+    block->untranslatable = true;
+    return false;
+#endif
+}
+
+// Emits the code for a single instruction, returns false if the instruction
+// is not supported (without emitting anything)
+bool Dynarec::translate_instruction(const DecodedInstruction& instruction) {
+    CPU& cpu = gb->cpu;
+
+    u8 opcode = instruction.opcode;
+    u8 x = opcode >> 6;
+    u8 y = (opcode >> 3) & 0x7;
+    u8 z = opcode & 0x7;
+    u8 p = y >> 1;
+    u8 q = y & 0x1;
+
+    int A = offset(&cpu.A);
+    int F = offset(&cpu.F);
+
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0: // NOP
+            return y == 0;
+        case 1:
+            if (q == 0) { // LD rp[p],d16
+                emit_mem(0x66, 0xC7, 0, pair_offset(p)); // mov word [rr], imm16
+                emit16(instruction.operand);
+                return true;
+            }
+            return false;
+        case 2: {
+            // LD (rr),A and LD A,(rr) with BC, DE, HL+ and HL-
+            emit_load_pair(p < 2 ? p : 2);
+
+            if (q == 0) {
+                emit_mem(0x0F, 0xB6, ECX, A); // movzx ecx, byte [A]
+                emit_call((void*)native_write);
+                emit_exit_on_failure();
+            } else {
+                emit_call((void*)native_read);
+                emit_exit_on_failure();
+                emit_mem(0x88, EAX, A); // mov [A], al
+            }
+
+            if (p >= 2) {
+                emit_load_pair(2);
+                if (p == 2) {
+                    emit(0xFF); emit(0xC0); // inc eax
+                } else {
+                    emit(0xFF); emit(0xC8); // dec eax
+                }
+                emit_store_pair(2);
+            }
+            return true;
+        }
+        case 3: // INC rp[p] and DEC rp[p]
+            emit_mem(0x66, 0xFF, q == 0 ? 0 : 1, pair_offset(p)); // inc/dec word [rr]
+            return true;
+        case 4: case 5: // INC r[y] and DEC r[y]
+            if (y == 6)
+                return false;
+            emit_mem(0x0F, 0xB6, EAX, reg_offset(y)); // movzx eax, byte [r]
+            emit(0xFE); emit(z == 4 ? 0xC0 : 0xC8); // inc/dec al
+            emit(0x9C); emit(0x59); // pushfq; pop rcx
+            emit_mem(0x88, EAX, reg_offset(y)); // mov [r], al
+            emit_store_flags(FLAG_ZERO | FLAG_HALF_CARRY, z == 4 ? 0 : FLAG_SUBTRACT, 0x1F);
+            return true;
+        case 6: // LD r[y],d8
+            if (y == 6) {
+                emit_load_pair(2);
+                emit(0xB9); emit32(instruction.operand & 0xFF); // mov ecx, imm32
+                emit_call((void*)native_write);
+                emit_exit_on_failure();
+            } else {
+                emit_mem(0xC6, 0, reg_offset(y)); // mov byte [r], imm8
+                emit(instruction.operand & 0xFF);
+            }
+            return true;
+        case 7:
+            switch (y) {
+            case 0: case 1: case 2: case 3: // RLCA, RRCA, RLA, RRA
+                emit_mem(0x0F, 0xB6, EAX, A); // movzx eax, byte [A]
+                if (y >= 2) {
+                    emit_mem(0x0F, 0xB6, EDX, F); // movzx edx, byte [F]
+                    emit(0x0F); emit(0xBA); emit(0xE2); emit(0x04); // bt edx, 4
+                }
+                // rol/ror/rcl/rcr al, 1
+                emit(0xD0); emit(0xC0 | ((y == 0 ? 0 : y == 1 ? 1 : y == 2 ? 2 : 3) << 3));
+                emit(0x9C); emit(0x59); // pushfq; pop rcx
+                emit_mem(0x88, EAX, A); // mov [A], al
+                emit_store_flags(FLAG_CARRY, 0, 0x0F);
+                return true;
+            case 5: // CPL
+                emit_mem(0xF6, 2, A); // not byte [A]
+                emit_mem(0x80, 1, F); emit(FLAG_SUBTRACT | FLAG_HALF_CARRY); // or byte [F], imm8
+                return true;
+            case 6: // SCF
+                emit_mem(0x80, 4, F); emit(0x8F); // and byte [F], imm8
+                emit_mem(0x80, 1, F); emit(FLAG_CARRY); // or byte [F], imm8
+                return true;
+            case 7: // CCF
+                emit_mem(0x80, 4, F); emit(0x9F); // and byte [F], imm8
+                emit_mem(0x80, 6, F); emit(FLAG_CARRY); // xor byte [F], imm8
+                return true;
+            }
+            return false;
+        }
+        return false;
+    case 1: // LD r[y],r[z]
+        if (y == 6 && z == 6) // HALT
+            return false;
+
+        if (y == 6) {
+            emit_load_pair(2);
+            emit_mem(0x0F, 0xB6, ECX, reg_offset(z)); // movzx ecx, byte [r]
+            emit_call((void*)native_write);
+            emit_exit_on_failure();
+        } else if (z == 6) {
+            emit_load_pair(2);
+            emit_call((void*)native_read);
+            emit_exit_on_failure();
+            emit_mem(0x88, EAX, reg_offset(y)); // mov [r], al
+        } else {
+            emit_mem(0x0F, 0xB6, EAX, reg_offset(z)); // movzx eax, byte [r]
+            emit_mem(0x88, EAX, reg_offset(y)); // mov [r], al
+        }
+        return true;
+    case 2: // ALU[y] r[z]
+        if (z == 6) {
+            emit_load_pair(2);
+            emit_call((void*)native_read);
+            emit_exit_on_failure();
+            emit(0x89); emit(0xC1); // mov ecx, eax
+        } else {
+            emit_mem(0x0F, 0xB6, ECX, reg_offset(z)); // movzx ecx, byte [r]
+        }
+        emit_alu(y, false, 0);
+        return true;
+    case 3:
+        switch (z) {
+        case 0:
+            // LDH (a8),A and LDH A,(a8), only to HRAM
+            if ((y == 4 || y == 6) && (instruction.operand & 0xFF) >= 0x80) {
+                emit(0xB8); emit32(0xFF00 | (instruction.operand & 0xFF)); // mov eax, imm32
+                if (y == 4) {
+                    emit_mem(0x0F, 0xB6, ECX, A); // movzx ecx, byte [A]
+                    emit_call((void*)native_write);
+                    emit_exit_on_failure();
+                } else {
+                    emit_call((void*)native_read);
+                    emit_exit_on_failure();
+                    emit_mem(0x88, EAX, A); // mov [A], al
+                }
+                return true;
+            }
+            return false;
+        case 1:
+            if (q == 1 && p == 3) { // LD SP,HL
+                emit_load_pair(2);
+                emit_store_pair(3);
+                return true;
+            }
+            return false;
+        case 2:
+            // LD (FF00+C),A  LD (a16),A  LD A,(FF00+C)  LD A,(a16)
+            if (y < 4)
+                return false;
+
+            if (y == 4 || y == 6) {
+                emit_mem(0x0F, 0xB6, EAX, reg_offset(1)); // movzx eax, byte [C]
+                emit(0x0D); emit32(0xFF00); // or eax, imm32
+            } else {
+                emit(0xB8); emit32(instruction.operand); // mov eax, imm32
+            }
+
+            if (y == 4 || y == 5) {
+                emit_mem(0x0F, 0xB6, ECX, A); // movzx ecx, byte [A]
+                emit_call((void*)native_write);
+                emit_exit_on_failure();
+            } else {
+                emit_call((void*)native_read);
+                emit_exit_on_failure();
+                emit_mem(0x88, EAX, A); // mov [A], al
+            }
+            return true;
+        case 3:
+            if (y == 1) { // CB prefix, only BIT/RES/SET on registers
+                u8 cb = instruction.operand & 0xFF;
+                u8 cb_x = cb >> 6;
+                u8 bit = 1 << ((cb >> 3) & 0x7);
+                u8 r = cb & 0x7;
+
+                if (cb_x == 0 || r == 6)
+                    return false;
+
+                if (cb_x == 1) { // BIT
+                    emit_mem(0x0F, 0xB6, EAX, reg_offset(r)); // movzx eax, byte [r]
+                    emit(0xA8); emit(bit); // test al, imm8
+                    emit(0x9C); emit(0x59); // pushfq; pop rcx
+                    emit_store_flags(FLAG_ZERO, FLAG_HALF_CARRY, 0x1F);
+                } else if (cb_x == 2) { // RES
+                    emit_mem(0x80, 4, reg_offset(r)); emit(~bit & 0xFF); // and byte [r], imm8
+                } else { // SET
+                    emit_mem(0x80, 1, reg_offset(r)); emit(bit); // or byte [r], imm8
+                }
+                return true;
+            }
+            return false;
+        case 6: // ALU[y] d8
+            emit_alu(y, true, instruction.operand & 0xFF);
+            return true;
+        }
+        return false;
+    }
+
+    return false;
+}
+
+int Dynarec::offset(const void* field) {
+    return (const u8*)field - (const u8*)&gb->cpu;
+}
+
+// BC, DE, HL, SP
+int Dynarec::pair_offset(int p) {
+    CPU& cpu = gb->cpu;
+    u16* pairs[4] = {&cpu.BC.value, &cpu.DE.value, &cpu.HL.value, &cpu.SP};
+
+    return offset(pairs[p]);
+}
+
+// B, C, D, E, H, L, -, A
+int Dynarec::reg_offset(int r) {
+    CPU& cpu = gb->cpu;
+    u8* registers[8] = {&cpu.B, &cpu.C, &cpu.D, &cpu.E, &cpu.H, &cpu.L, NULL, &cpu.A};
+
+    return offset(registers[r]);
+}
+
+void Dynarec::emit(u8 byte) {
+    code.push_back(byte);
+}
+
+void Dynarec::emit16(u16 value) {
+    emit(value & 0xFF);
+    emit(value >> 8);
+}
+
+void Dynarec::emit32(unsigned int value) {
+    for (int i = 0; i < 4; i++)
+        emit((value >> (i * 8)) & 0xFF);
+}
+
+// Instruction with a [rbx + disp32] memory operand, reg is either a
+// register or the opcode extension
+void Dynarec::emit_mem(u8 opcode, int reg, int field) {
+    emit(opcode);
+    emit(0x83 | (reg << 3));
+    emit32(field);
+}
+
+void Dynarec::emit_mem(u8 prefix, u8 opcode, int reg, int field) {
+    emit(prefix);
+    emit_mem(opcode, reg, field);
+}
+
+void Dynarec::emit_return(unsigned int result) {
+    emit(0xB8); emit32(result); // mov eax, imm32
+#if defined(_WIN32)
+    emit(0x48); emit(0x83); emit(0xC4); emit(0x20); // add rsp, 32
+#endif
+    emit(0x5B); // pop rbx
+    emit(0xC3); // ret
+}
+
+// Leaves the block if the last memory access returned -1
+void Dynarec::emit_exit_on_failure() {
+    emit(0x85); emit(0xC0); // test eax, eax
+    emit(0x79); // jns rel8
+    std::size_t jump = code.size();
+    emit(0);
+
+    emit_return(exit_result);
+    code[jump] = code.size() - jump - 1;
+}
+
+// Leaves the block if the instructions so far used up the cycle budget
+void Dynarec::emit_exit_on_deadline(int cycles) {
+    emit_mem(0x83, 7, offset(&gb->cpu.dynarec.cycle_budget)); // cmp dword [budget], imm8
+    emit(cycles);
+    emit(0x7F); // jg rel8
+    std::size_t jump = code.size();
+    emit(0);
+
+    emit_return(exit_result);
+    code[jump] = code.size() - jump - 1;
+}
+
+// Calls a memory access function with the address in eax and the value
+// to write (if any) in ecx
+void Dynarec::emit_call(void* function) {
+#if defined(_WIN32)
+    emit(0x41); emit(0x89); emit(0xC8); // mov r8d, ecx
+    emit(0x89); emit(0xC2); // mov edx, eax
+    emit(0x48); emit(0x89); emit(0xD9); // mov rcx, rbx
+#else
+    emit(0x89); emit(0xCA); // mov edx, ecx
+    emit(0x89); emit(0xC6); // mov esi, eax
+    emit(0x48); emit(0x89); emit(0xDF); // mov rdi, rbx
+#endif
+
+    unsigned long long address = (unsigned long long)function;
+    emit(0x48); emit(0xB8); // mov rax, imm64
+    emit32(address & 0xFFFFFFFF);
+    emit32(address >> 32);
+    emit(0xFF); emit(0xD0); // call rax
+}
+
+// Loads BC, DE, HL or SP into eax
+void Dynarec::emit_load_pair(int p) {
+    emit_mem(0x0F, 0xB7, EAX, pair_offset(p)); // movzx eax, word [rr]
+}
+
+// Stores ax into BC, DE, HL or SP
+void Dynarec::emit_store_pair(int p) {
+    emit_mem(0x66, 0x89, EAX, pair_offset(p)); // mov [rr], ax
+}
+
+// Builds F from the host flags in ecx (pushed right after the operation).
+// from_host: Z/H/C flags taken from the host ZF/AF/CF, forced: flags that
+// are always set, kept: bits of the old F that are preserved.
+void Dynarec::emit_store_flags(u8 from_host, u8 forced, u8 kept) {
+    int F = offset(&gb->cpu.F);
+
+    emit(0x89); emit(0xCA); // mov edx, ecx
+    emit(0x83); emit(0xE1); emit(0x50); // and ecx, ZF | AF
+    emit(0xD1); emit(0xE1); // shl ecx, 1
+    emit(0x83); emit(0xE2); emit(0x01); // and edx, CF
+    emit(0xC1); emit(0xE2); emit(0x04); // shl edx, 4
+    emit(0x09); emit(0xD1); // or ecx, edx
+    emit(0x83); emit(0xE1); emit(from_host); // and ecx, imm8
+    if (forced) {
+        emit(0x83); emit(0xC9); emit(forced); // or ecx, imm8
+    }
+    emit_mem(0x0F, 0xB6, EDX, F); // movzx edx, byte [F]
+    emit(0x83); emit(0xE2); emit(kept); // and edx, imm8
+    emit(0x09); emit(0xD1); // or ecx, edx
+    emit_mem(0x88, ECX, F); // mov [F], cl
+}
+
+// ADD, ADC, SUB, SBC, AND, XOR, OR or CP with A. The operand is either in
+// ecx or an immediate value.
+void Dynarec::emit_alu(int y, bool immediate, u8 value) {
+    // Host opcodes for "op al, cl" and "op al, imm8"
+    const u8 register_opcodes[8] = {0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38};
+    const u8 immediate_opcodes[8] = {0x04, 0x14, 0x2C, 0x1C, 0x24, 0x34, 0x0C, 0x3C};
+
+    int A = offset(&gb->cpu.A);
+    int F = offset(&gb->cpu.F);
+
+    emit_mem(0x0F, 0xB6, EAX, A); // movzx eax, byte [A]
+
+    // Load the carry flag for ADC and SBC
+    if (y == 1 || y == 3) {
+        emit_mem(0x0F, 0xB6, EDX, F); // movzx edx, byte [F]
+        emit(0x0F); emit(0xBA); emit(0xE2); emit(0x04); // bt edx, 4
+    }
+
+    if (immediate) {
+        emit(immediate_opcodes[y]); emit(value);
+    } else {
+        emit(register_opcodes[y]); emit(0xC8);
+    }
+
+    emit(0x9C); emit(0x59); // pushfq; pop rcx
+
+    // CP only sets the flags
+    if (y != 7)
+        emit_mem(0x88, EAX, A); // mov [A], al
+
+    switch (y) {
+    case 0: case 1: // ADD, ADC
+        emit_store_flags(FLAG_ZERO | FLAG_HALF_CARRY | FLAG_CARRY, 0, 0x0F);
+        break;
+    case 2: case 3: case 7: // SUB, SBC, CP
+        emit_store_flags(FLAG_ZERO | FLAG_HALF_CARRY | FLAG_CARRY, FLAG_SUBTRACT, 0x0F);
+        break;
+    case 4: // AND
+        emit_store_flags(FLAG_ZERO, FLAG_HALF_CARRY, 0x0F);
+        break;
+    case 5: case 6: // XOR, OR
+        emit_store_flags(FLAG_ZERO, 0, 0x0F);
+        break;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef DYNAREC_H
+#define DYNAREC_H
+
+#include <vector>
+
+#include "blockcache.h"
+#include "def.h"
+
+class GameBoy;
+
+/*
+    Dynamic recompiler for x86-64 hosts
+
+    Blocks from the block cache that are executed often are translated into
+    native code which works directly on the CPU registers. Only straight-line
+    code is translated: translation stops at the first instruction that is
+    not supported (jumps, calls, stack operations, ...) and the interpreter
+    continues from there.
+
+    Memory is accessed through the MMU. Translated code exits back to the
+    interpreter right before an access to the I/O registers (FF00-FF7F), a
+    write to the interrupt enable register or a write to the cartridge, which
+    could switch banks. The cycles of every instruction come from
+    opcode_cycles, just like in the interpreter.
+
+    A run also ends once it reaches the next scheduled event, so events and
+    interrupts happen after the same instruction as in the interpreter.
+*/
+class Dynarec {
+public:
+    Dynarec(GameBoy* gb);
+    ~Dynarec();
+
+    int execute();
+    void flush();
+
+private:
+    bool translate(Block* block);
+    bool translate_instruction(const DecodedInstruction& instruction);
+
+    int offset(const void* field);
+    int reg_offset(int r);
+    int pair_offset(int p);
+
+    void emit(u8 byte);
+    void emit16(u16 value);
+    void emit32(unsigned int value);
+    void emit_mem(u8 opcode, int reg, int field);
+    void emit_mem(u8 prefix, u8 opcode, int reg, int field);
+    void emit_return(unsigned int result);
+    void emit_exit_on_failure();
+    void emit_exit_on_deadline(int cycles);
+    void emit_call(void* function);
+    void emit_load_pair(int p);
+    void emit_store_pair(int p);
+    void emit_store_flags(u8 from_host, u8 forced, u8 kept);
+    void emit_alu(int y, bool immediate, u8 value);
+
+public:
+    GameBoy* gb;
+
+    bool enabled;
+
+    // Executable memory for the translated blocks
+    u8* code_buffer;
+    std::size_t code_used;
+
+    // The block being translated
+    std::vector<u8> code;
+    unsigned int exit_result;
+
+    // Cycles until the next event, the translated code returns once they
+    // are used up
+    int cycle_budget;
+};
+
+#endif
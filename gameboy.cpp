@@ -1,12 +1,21 @@
 #include "gameboy.h"
 
+#include <algorithm>
+
+// The bit of the divider that increments TIMA when it goes from 1 to 0,
+// selected by the lower two bits of TAC. This gives 4096, 262144, 65536 and
+// 16384 Hz.
+const int TIMER_BITS[4] = {9, 3, 5, 7};
+
 GameBoy::GameBoy(const std::string& filename) :
 	buttons({false}),
+    scheduler(),
     cartridge(filename),
     apu(this),
     cpu(this),
     gpu(this),
-    mmu(this) {
+    mmu(this),
+    mapper(this) {
     select_button = false;
     select_direction = false;
     down_or_start = true;
@@ -14,8 +23,8 @@ GameBoy::GameBoy(const std::string& filename) :
     left_or_b = true;
     right_or_a = true;
 
-    divide_register = 0;
-    raw_timer_counter = 0;
+    divider = 0;
+    timer_updated_at = 0;
     timer_counter = 0;
     timer_modulo = 0;
     timer_control = 0;
@@ -27,6 +36,15 @@ GameBoy::GameBoy(const std::string& filename) :
     interrupt_enable = 0;
 
     debug_mode = false;
+    render_requested = true;
+
+    stats.halted_cycles_skipped = 0;
+    stats.idle_cycles_skipped = 0;
+
+    // The GPU sets up LY=LYC after the first instruction, the timer is
+    // disabled until TAC is written
+    scheduler.schedule(Event::GPU, 0);
+    scheduler.schedule(Event::APU, apu.cycles_until_event());
 }
 
 GameBoy::~GameBoy() {
@@ -60,9 +78,11 @@ u8 GameBoy::read_byte(u16 address) {
 
         break;
     case 0x04: // Divider
-        result = divide_register;
+        update_timers();
+        result = divider >> 8;
         break;
     case 0x05: // Timer counter
+        update_timers();
         result = timer_counter;
         break;
     case 0x06: // Timer modulo
@@ -92,45 +112,125 @@ void GameBoy::write_byte(u16 address, u8 value) {
 
         break;
     case 0x04: // Divider
-        divide_register = 0;
+        update_timers();
+
+        // Resetting the divider is a falling edge if the timer bit was set
+        if ((timer_control & 0b100) && GET_BIT(divider, TIMER_BITS[timer_control & 0b11]))
+            add_timer_ticks(1);
+
+        divider = 0;
+        schedule_timer();
         break;
     case 0x05: // Timer counter
+        update_timers();
         timer_counter = value;
+        schedule_timer();
         break;
     case 0x06: // Timer modulo
+        update_timers();
         timer_modulo = value;
         //std::cout << std::hex << "setting timer_modulo=" << (int)timer_modulo << std::endl;
         break;
     case 0x07: // Timer control
+        update_timers();
         timer_control = value;
+        schedule_timer();
         //std::cout << std::hex << "setting timer_control=" << (int)timer_control << std::endl;
         break;
     case 0x0F: // Interrupt flags
         interrupt_flags = value;
+
+        // The GPU requests the LY=LYC interrupt again while the line matches
+        scheduler.schedule(Event::GPU, cpu.cycles);
         break;
     }
 }
 
+// Brings the timer up to date with the CPU, this happens when the timer
+// registers are accessed and when TIMA could overflow
 void GameBoy::update_timers() {
-    float timer = ((float)cpu.cycles / (float)CLOCK_FREQ) * (float)TIMER_FREQ;
-    divide_register = (int)timer & 0xFF;
+    unsigned int elapsed = cpu.cycles - timer_updated_at;
+    timer_updated_at = cpu.cycles;
+
+    u64 start = divider;
+    u64 end = start + elapsed;
+    divider = end & 0xFFFF;
 
-    // If the timer is enabled
+    // If the timer is enabled, count the falling edges of the timer bit
     if (timer_control & 0b100) {
-        int frequencies[4] = {4096, 262144, 65536, 16384};
-        int freq = frequencies[timer_control & 0b11];
-
-        raw_timer_counter += (float)cpu.elapsed_cycles / (float)CLOCK_FREQ * (float)freq;
-        //std::cout << "timer_counter=" << (int)timer_counter << std::endl;
-        
-        // If we overflow the timer
-        if ((int)raw_timer_counter > 0xFF) {
-            //std::cout << "timer_counter overflow!" << std::endl;
-            interrupt_flags |= INTERRUPT_TIMER;
-            raw_timer_counter = timer_modulo;
-            timer_counter = timer_modulo;
-        } else
-            timer_counter = (int)raw_timer_counter & 0xFF;
+        int shift = TIMER_BITS[timer_control & 0b11] + 1;
+        add_timer_ticks((end >> shift) - (start >> shift));
+    }
+}
+
+void GameBoy::add_timer_ticks(u64 ticks) {
+    u64 counter = timer_counter + ticks;
+
+    // If we overflow the timer it restarts from TMA, and it can overflow
+    // more than once if the timer was not updated for a while
+    if (counter > 0xFF) {
+        interrupt_flags |= INTERRUPT_TIMER;
+        counter = timer_modulo + (counter - 0x100) % (0x100 - timer_modulo);
+    }
+
+    timer_counter = counter;
+}
+
+// Sets the deadline of the timer to the next TIMA overflow
+void GameBoy::schedule_timer() {
+    if (timer_control & 0b100)
+        scheduler.schedule(Event::Timer, timer_updated_at + cycles_until_timer_overflow());
+    else
+        scheduler.cancel(Event::Timer);
+}
+
+// The number of cycles after the last update until TIMA overflows
+int GameBoy::cycles_until_timer_overflow() {
+    int period = 1 << (TIMER_BITS[timer_control & 0b11] + 1);
+    int next_tick = period - (divider & (period - 1));
+
+    return next_tick + (0xFF - timer_counter) * period;
+}
+
+// The number of cycles the CPU can run before the timer, GPU or APU need to
+// be updated. This is 0 or negative if that is already the case.
+int GameBoy::cycles_until_event() {
+    // A requested interrupt ends a HALT right away
+    if (interrupt_enable & interrupt_flags)
+        return 0;
+
+    return scheduler.cycles_until_next(cpu.cycles);
+}
+
+// Updates all the components whose deadline has passed
+void GameBoy::run_events() {
+    Event::Type event;
+
+    while (scheduler.pop(cpu.cycles, event)) {
+        switch (event) {
+        case Event::Timer:
+            update_timers();
+            schedule_timer();
+            break;
+        case Event::GPU:
+            gpu.cycle();
+            break;
+        case Event::APU:
+            apu.update();
+            break;
+        case Event::SaveRam:
+            // Hand the written pages to the flush thread, and trap writes
+            // to them again
+            cartridge.ram.commit();
+            mmu.map_cartridge();
+            break;
+        case Event::RTC:
+            mapper.save_clock();
+            scheduler.schedule(Event::RTC, cpu.cycles + CLOCK_SAVE_INTERVAL);
+            break;
+        default:
+            break;
+        }
     }
 }
 
@@ -157,20 +257,33 @@ void GameBoy::handle_interrupts() {
 
             cpu.handle_interrupt(handlers[i]);
 
+            // The GPU requests the LY=LYC interrupt again while the line matches
+            if (flag == INTERRUPT_LCDC)
+                scheduler.schedule(Event::GPU, cpu.cycles);
+
             break;
         }
     }
 }
 
-void GameBoy::cycle() {
+// Executes a single instruction, and updates the other components if one of
+// them reached its deadline. Returns whether that was the case.
+bool GameBoy::step() {
     cpu.execute_opcode();
 
-    update_timers();
+    bool due = scheduler.is_due(cpu.cycles);
+    if (due)
+        run_events();
+
     handle_interrupts();
 
-    gpu.cycle();
+    return due;
+}
+
+// Runs the CPU without interruption until the timer, GPU or APU need to be
+// updated, the redraw flag of the GPU is only valid until the next call
+void GameBoy::cycle() {
+    gpu.redraw = false;
 
-    // APU should run at 4 MHz
-    for (int i = 0; i < cpu.elapsed_cycles; i++) 
-        apu.cycle();
+    while (!step());
 }
\ No newline at end of file
@@ -7,7 +7,15 @@
 #include "apu.h"
 #include "cpu.h"
 #include "gpu.h"
+#include "mapper.h"
 #include "mmu.h"
+#include "scheduler.h"
+
+// Counters for profiling, these are not part of the emulated state
+struct Stats {
+    u64 halted_cycles_skipped; // Cycles fast-forwarded while halted
+    u64 idle_cycles_skipped; // Cycles fast-forwarded in idle loops
+};
 
 namespace Button {
 	enum Type {Up, Down, Left, Right, Start, Select, A, B};
@@ -22,17 +30,25 @@ public:
     void write_byte(u16 address, u8 value);
 
     void update_timers();
+    void add_timer_ticks(u64 ticks);
+    void schedule_timer();
+    int cycles_until_timer_overflow();
+    int cycles_until_event();
+    void run_events();
     void handle_interrupts();
 
+    bool step();
     void cycle();
 
 public:
 	bool buttons[8];
+    Scheduler scheduler;
     Cartridge cartridge;
     APU apu;
     CPU cpu;
     GPU gpu;
     MMU mmu;
+    Mapper mapper;
 
     // FF00 joypad input byte
     bool select_button;
@@ -42,8 +58,8 @@ public:
     bool left_or_b;
     bool right_or_a;
 
-    u8 divide_register; // FF04, DIV
-    float raw_timer_counter;
+    u16 divider; // Counts every cycle, the upper byte is FF04, DIV
+    unsigned int timer_updated_at; // CPU cycle the timer was last updated
     u8 timer_counter; // FF05, TIMA
     u8 timer_modulo; // FF06, TMA
     u8 timer_control; // FF07, TAC
@@ -55,6 +71,12 @@ public:
     u8 interrupt_enable; // FFFF, IE
 
     bool debug_mode;
+
+    // Whether the GPU draws the next frame, it is read when the frame starts.
+    // Without drawing the GPU still keeps its timing and interrupts.
+    bool render_requested;
+
+    Stats stats;
 };
 
 #endif
\ No newline at end of file
@@ -1,10 +1,150 @@
 #include "gpu.h"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <iostream>
 
 #include "gameboy.h"
 
-GPU::GPU(GameBoy* gb) : gb(gb), mode(GPUMode::HBlank), cycles(0) {
+// Scanlines are composed 8 pixels at a time with vector instructions if the
+// compiler targets SSSE3 (-mssse3, or -mavx2 which includes it), the palette
+// lookup needs its byte shuffle
+#if !defined(GPU_SCALAR) && defined(__SSSE3__)
+#include <tmmintrin.h>
+#define GPU_SSSE3
+#endif
+
+// Spreads the bits of a byte of tile data over the 8 bytes of a row of
+// pixels, bit 7 (the leftmost pixel) ends up in the first byte in memory
+static std::array<u64, 256> make_pixel_table() {
+    std::array<u64, 256> table;
+
+    for (int byte = 0; byte < 256; byte++) {
+        u8 pixels[8];
+        for (int x = 0; x < 8; x++)
+            pixels[x] = (byte >> (7 - x)) & 1;
+        memcpy(&table[byte], pixels, 8);
+    }
+
+    return table;
+}
+
+static const std::array<u64, 256> PIXEL_TABLE = make_pixel_table();
+
+// XXH64 primes
+const u64 PRIME_1 = 0x9E3779B185EBCA87ULL;
+const u64 PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+const u64 PRIME_3 = 0x165667B19E3779F9ULL;
+const u64 PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+const u64 PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+static inline u64 rotate_left(u64 x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline u64 hash_round(u64 hash, u64 input) {
+    return rotate_left(hash + input * PRIME_2, 31) * PRIME_1;
+}
+
+static inline u64 hash_merge(u64 hash, u64 lane) {
+    return (hash ^ hash_round(0, lane)) * PRIME_1 + PRIME_4;
+}
+
+static inline u64 hash_avalanche(u64 hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME_2;
+    hash ^= hash >> 29;
+    hash *= PRIME_3;
+    return hash ^ (hash >> 32);
+}
+
+// XXH64 of a line of the screen, the 160 bytes are exactly 5 stripes of the
+// 4 independent lanes so there is no tail to handle
+static u64 hash_line(const u8* line) {
+    u64 lanes[4] = {PRIME_1 + PRIME_2, PRIME_2, 0, 0 - PRIME_1};
+
+    for (int offset = 0; offset < PIXELS_W; offset += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            u64 input;
+            memcpy(&input, line + offset + lane * 8, 8);
+            lanes[lane] = hash_round(lanes[lane], input);
+        }
+    }
+
+    u64 hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) +
+               rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+    for (int lane = 0; lane < 4; lane++)
+        hash = hash_merge(hash, lanes[lane]);
+
+    return hash_avalanche(hash + PIXELS_W);
+}
+
+// The reference compositor, one pixel at a time. shades holds the shade of
+// each of the 4 values after applying the palette.
+static void draw_span_scalar(u8* out, const u8* values, const u8* shades, int count) {
+    for (int i = 0; i < count; i++)
+        out[i] = shades[values[i]];
+}
+
+// Draws the non transparent pixels of a row of a sprite, sprites behind the
+// background only show where the screen has shade 0
+static void draw_sprite_scalar(u8* out, const u8* row, bool x_flip, bool priority,
+                               const u8* shades, int count) {
+    for (int x = 0; x < count; x++) {
+        int value = row[x_flip ? (7 - x) : x];
+
+        if (value != 0 && (!priority || out[x] == 0))
+            out[x] = shades[value];
+    }
+}
+
+// The vector compositor draws a whole row of a tile at once. The palette is
+// applied by shuffling the 4 shades with the values as indices.
+#if defined(GPU_SSSE3)
+static inline __m128i load_shades(const u8* shades) {
+    int packed;
+    memcpy(&packed, shades, 4);
+    return _mm_cvtsi32_si128(packed);
+}
+
+static void draw_row_simd(u8* out, const u8* row, const u8* shades) {
+    __m128i values = _mm_loadl_epi64((const __m128i*)row);
+    _mm_storel_epi64((__m128i*)out, _mm_shuffle_epi8(load_shades(shades), values));
+}
+
+static void draw_sprite_simd(u8* out, const u8* row, bool x_flip, bool priority,
+                             const u8* shades) {
+    __m128i values = _mm_loadl_epi64((const __m128i*)row);
+    if (x_flip)
+        values = _mm_shuffle_epi8(values, _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                                       0, 1, 2, 3, 4, 5, 6, 7));
+
+    __m128i pixels = _mm_loadl_epi64((const __m128i*)out);
+    __m128i sprite = _mm_shuffle_epi8(load_shades(shades), values);
+
+    // Pixels where the sprite is transparent, or hidden behind the background
+    __m128i hidden = _mm_cmpeq_epi8(values, _mm_setzero_si128());
+    if (priority)
+        hidden = _mm_or_si128(hidden, _mm_xor_si128(_mm_cmpeq_epi8(pixels, _mm_setzero_si128()),
+                                                    _mm_set1_epi8(-1)));
+
+    _mm_storel_epi64((__m128i*)out, _mm_or_si128(_mm_and_si128(hidden, pixels),
+                                                 _mm_andnot_si128(hidden, sprite)));
+}
+#else
+// Without vector instructions both compositors are the reference one
+static void draw_row_simd(u8* out, const u8* row, const u8* shades) {
+    draw_span_scalar(out, row, shades, 8);
+}
+
+static void draw_sprite_simd(u8* out, const u8* row, bool x_flip, bool priority,
+                             const u8* shades) {
+    draw_sprite_scalar(out, row, x_flip, priority, shades, 8);
+}
+#endif
+
+GPU::GPU(GameBoy* gb) : gb(gb), mode(GPUMode::HBlank), cycles(0), updated_at(0) {
     lcd_enabled = false;
     window_tilemap = false;
     window_enabled = false;
@@ -18,6 +158,14 @@ GPU::GPU(GameBoy* gb) : gb(gb), mode(GPUMode::HBlank), cycles(0) {
 
     scroll_x = scroll_y = 0;
     current_line = 0;
+    window_x = window_y = 0;
+    window_line = 0;
+    rendering = true;
+
+    hash_frames = false;
+    hashed_lines = 0;
+    line_hashes = PRIME_5;
+    last_frame_hash = 0;
     ly_compare = 0;
 
     background_palette = 0;
@@ -38,18 +186,27 @@ GPU::GPU(GameBoy* gb) : gb(gb), mode(GPUMode::HBlank), cycles(0) {
     color_palette[3] = 0x081820FF;
 
     redraw = false;
+#if defined(GPU_SSSE3)
+    simd_compositor = true;
+#else
+    simd_compositor = false;
+#endif
 
-    screen.resize(PIXELS_W * PIXELS_H);
-    std::fill(screen.begin(), screen.end(), color_palette[0]);
+    screen.resize(PIXELS_W * PIXELS_H, 0);
+    rgba_screen.resize(PIXELS_W * PIXELS_H);
 
     // 256+128=384 unique tiles, each consisting of 8*8 pixels
     tileset.resize((256 + 128) * 8 * 8);
+    dirty_tiles.resize(256 + 128, true);
 
     // Initialize the sprites collection
     for (int i = 0; i < 40; i++) {
         Sprite s = {0, 0, 0, false, false, false, false};
         sprites.push_back(s);
     }
+    line_sprites.resize(PIXELS_H * MAX_LINE_SPRITES);
+    line_sprite_counts.resize(PIXELS_H);
+    sprites_changed = true;
 }
 
 u8 GPU::read_byte(u16 address) {
@@ -89,10 +246,10 @@ u8 GPU::read_byte(u16 address) {
             result = sprite_palette_1;
             break;
         case 0x4A: // Window Y
-
+            result = window_y;
             break;
         case 0x4B: // Window X
-
+            result = window_x;
             break;
         default: {
             result = 0;
@@ -111,6 +268,9 @@ void GPU::write_byte(u16 address, u8 value) {
         // Set only bits 3-6
         u8 mask = 0b01111000;
         lcd_status = (lcd_status & ~mask) | (value & mask);
+
+        // Check for LY=LYC after this instruction
+        gb->scheduler.schedule(Event::GPU, gb->cpu.cycles);
         } break;
     case 0x42: // Scroll Y
         scroll_y = value;
@@ -120,6 +280,7 @@ void GPU::write_byte(u16 address, u8 value) {
         break;
     case 0x45: // LY compare
         ly_compare = value;
+        gb->scheduler.schedule(Event::GPU, gb->cpu.cycles);
         break;
     case 0x46: { // DMA transfer start address
         u16 start_addr = (value << 8);
@@ -138,18 +299,19 @@ void GPU::write_byte(u16 address, u8 value) {
         sprite_palette_1 = value;
         break;
     case 0x4A: // Window Y
-
+        window_y = value;
         break;
     case 0x4B: // Window X
-
+        window_x = value;
         break;
     }
 }
 
+// Brings the GPU up to date with the CPU. At most one mode change happens
+// per call, a following one is scheduled for after the next instruction.
 void GPU::cycle() {
-    redraw = false;
-
-    cycles += gb->cpu.get_elapsed_cycles();
+    cycles += gb->cpu.cycles - updated_at;
+    updated_at = gb->cpu.cycles;
 
     switch (mode) {
     case GPUMode::OAM: // Draw sprites
@@ -169,7 +331,7 @@ void GPU::cycle() {
             if (GET_BIT(lcd_status, 3))
                     gb->interrupt_flags |= INTERRUPT_LCDC;
 
-            if (lcd_enabled)
+            if (lcd_enabled && rendering)
                 render_scanline();
         }
         break;
@@ -186,6 +348,9 @@ void GPU::cycle() {
                     gb->interrupt_flags |= INTERRUPT_LCDC;
                 redraw = true;
 
+                if (hash_frames && rendering)
+                    finish_frame_hash();
+
                 // Request a VBlank interrupt
                 gb->interrupt_flags |= INTERRUPT_VBLANK;
                 //std::cout << "requesting vblank interrupt, IE=" << std::hex << (int)gb->interrupt_enable << " IME=" << (int)gb->interrupt_master_enable << std::endl;
@@ -211,6 +376,8 @@ void GPU::cycle() {
                     gb->interrupt_flags |= INTERRUPT_LCDC;
 
                 current_line = 0;
+                window_line = 0;
+                rendering = gb->render_requested;
             }
         }
         break;
@@ -222,33 +389,53 @@ void GPU::cycle() {
     // If LY=LYC interrupt is enabled and LY=LYC
     if (GET_BIT(lcd_status, 6) && GET_BIT(lcd_status, 2))
         gb->interrupt_flags |= INTERRUPT_LCDC;
+
+    gb->scheduler.schedule(Event::GPU, updated_at + std::max(cycles_until_event(), 1));
+}
+
+// The number of cycles until the next mode change
+int GPU::cycles_until_event() {
+    int mode_cycles = 0;
+
+    switch (mode) {
+    case GPUMode::OAM: mode_cycles = T_LINE_OAM; break;
+    case GPUMode::VRAM: mode_cycles = T_LINE_VRAM; break;
+    case GPUMode::HBlank: mode_cycles = T_HBLANK; break;
+    case GPUMode::VBlank: mode_cycles = T_LINE; break;
+    }
+
+    return mode_cycles > cycles ? mode_cycles - cycles : 0;
 }
 
 void GPU::reset() {
 
 }
 
-void GPU::update_tile(u16 address, u8 value) {
-    // Find the vram address where this row of pixels (2 bytes) starts
-    // The AND at the end sets the last bit to 0
-    int address_rel = (address - 0x8000) & ~1;
+// Called for every write to the tile data, the tile is decoded when it is
+// used next
+void GPU::update_tile(u16 address) {
+    dirty_tiles[(address & 0x1FFF) >> 4] = true;
+}
 
-    //if ((int)gb->mmu.vram[address_rel] == 0x4C)
-    //    std::cout << "Read all tiles in memory" << std::endl;
+void GPU::decode_tile(int tile) {
+    const u8* data = &gb->mmu.vram[tile * 16];
+    u8* pixels = &tileset[tile * 64];
 
-    // For all 8 pixels read the color value (0-3) and store in the gpu tileset
-    for (int x = 0; x < 8; x++) {
-        // Mask to check bit x
-        u8 mask = 1 << (7 - x);
+    // The first byte of a row holds the LSB of the color values and the
+    // second byte holds the MSB
+    for (int y = 0; y < 8; y++) {
+        u64 row = PIXEL_TABLE[data[y * 2]] | (PIXEL_TABLE[data[y * 2 + 1]] << 1);
+        memcpy(pixels + y * 8, &row, 8);
+    }
 
-        // The first byte in VRAM holds the LSB of the color value
-        // and the second byte holds the MSB
-        u8 value = ((gb->mmu.vram[address_rel]     & mask) ? 1 : 0) |
-                   ((gb->mmu.vram[address_rel + 1] & mask) ? 2 : 0);
+    dirty_tiles[tile] = false;
+}
 
-        // Multiply by 4 to go from the 2 bytes per row in vram to the
-        // 8 pixels per row in the gpu tileset
-        tileset[address_rel * 4 + x] = value;
+// Brings the whole tileset up to date, for code that reads it directly
+void GPU::decode_tiles() {
+    for (int tile = 0; tile < 256 + 128; tile++) {
+        if (dirty_tiles[tile])
+            decode_tile(tile);
     }
 }
 
@@ -259,9 +446,11 @@ void GPU::update_object(u16 address, u8 value) {
 
     switch (address & 0x3) {
     case 0x0:
+        sprites_changed |= sprites[index].y != (u8)(value - 16);
         sprites[index].y = value - 16;
         break;
     case 0x1:
+        sprites_changed |= sprites[index].x != (u8)(value - 8);
         sprites[index].x = value - 8;
         break;
     case 0x2:
@@ -276,100 +465,144 @@ void GPU::update_object(u16 address, u8 value) {
     }
 }
 
-void GPU::render_scanline() {
-    if (background_enabled) {
-        // The current pixel position in either the x or y direction
-        // divided by 8 give the location in the background tilemap
-        int tile_x = scroll_x >> 3;
-        int tile_y = ((current_line + scroll_y) & 0xFF) >> 3;
+// Finds the sprites on every line, like the OAM search of the hardware
+// does for a single line. Only the first 10 sprites in OAM on a line are
+// shown. They are stored in the order they are drawn: the sprite with the
+// smallest X coordinate, or the first in OAM if those are equal, is drawn
+// last so it ends up on top.
+void GPU::scan_sprites() {
+    std::fill(line_sprite_counts.begin(), line_sprite_counts.end(), 0);
+
+    for (int i = 0; i < (int)sprites.size(); i++) {
+        for (int line = sprites[i].y; line < sprites[i].y + 8 && line < PIXELS_H; line++) {
+            u8& count = line_sprite_counts[line];
+            if (count < MAX_LINE_SPRITES)
+                line_sprites[line * MAX_LINE_SPRITES + count++] = i;
+        }
+    }
 
-        // The last 3 bits of the leftmost pixel of the current
-        // scanline give the pixel coordinates in the first tile
-        int pixel_x = scroll_x & 7;
-        int pixel_y = (current_line + scroll_y) & 7;
+    for (int line = 0; line < PIXELS_H; line++) {
+        u8* first = &line_sprites[line * MAX_LINE_SPRITES];
 
-        // The offset address in VRAM for either tilemap 1 or 0
-        int tilemap_offset = (background_tilemap ? 0x1C00 : 0x1800);
+        // X is compared without the offset of 8, so sprites partly left of
+        // the screen come first
+        std::sort(first, first + line_sprite_counts[line], [this](u8 a, u8 b) {
+            u8 a_x = sprites[a].x + 8;
+            u8 b_x = sprites[b].x + 8;
+            return a_x != b_x ? a_x > b_x : a > b;
+        });
+    }
+
+    sprites_changed = false;
+}
 
-        // Position in the screen buffer
-        int canvas_offset = current_line * PIXELS_W;
+// Draws the pixels from start up to end of a line from a tilemap, beginning
+// at pixel (map_x, map_y) of the map
+void GPU::draw_tilemap(u8* line, int start, int end, int tilemap_offset, int map_x, int map_y, const u8* shades) {
+    // The pixel position in either the x or y direction divided by 8
+    // gives the location in the tilemap
+    int tile_x = (map_x & 0xFF) >> 3;
+    int tile_y = (map_y & 0xFF) >> 3;
 
+    // The last 3 bits give the pixel coordinates in the tile
+    int pixel_y = map_y & 7;
+
+    // Draw the tiles the span touches, the first (map_x & 7) pixels of the
+    // first one are left of the start
+    for (int x = start - (map_x & 7); x < end; x += 8) {
         int tile = gb->mmu.vram[tilemap_offset + tile_y * 32 + tile_x];
-        //std::cout << "drawing tile " << std::dec << tile << std::endl;
+        // Only use last 5 bits to stay in the range 0-31
+        tile_x = (tile_x + 1) & 31;
 
-        //std::cout << background_tileset << " " << (tile < 128) << std::endl;
         if (!background_tileset && tile < 128)
             tile += 256;
+        const u8* row = get_tile(tile) + pixel_y * 8;
+
+        // The tiles on the edges are only partly drawn
+        if (simd_compositor && x >= start && x + 8 <= end) {
+            draw_row_simd(line + x, row, shades);
+        } else {
+            int first = std::max(x, start);
+            int last = std::min(x + 8, end);
+            draw_span_scalar(line + first, row + (first - x), shades, last - first);
+        }
+    }
+}
 
-        // Start rendering the whole scanline
-        for (int i = 0; i < PIXELS_W; i++) {
-            // Retrieve the pixel value from the precalculated tileset
-            int value = tileset[tile * 64 + pixel_y * 8 + pixel_x];
-            //std::cout << "Tile: " << std::dec << tile << " " << std::dec << pixel_x << " " << pixel_y << std::endl;
-
-            // Extract the color from the palette
-            int color = (background_palette >> (value * 2)) & 0x3;
-
-            screen[canvas_offset] = color_palette[color];
+void GPU::render_scanline() {
+    // The shades of the 4 values with the palette applied
+    u8 shades[4];
 
-            // Move to the next pixel
-            canvas_offset++;
-            pixel_x++;
+    // The window and the background are both turned off by the same bit
+    if (background_enabled) {
+        for (int value = 0; value < 4; value++)
+            shades[value] = (background_palette >> (value * 2)) & 0x3;
 
-            // When we reach the next tile, move to it
-            if (pixel_x == 8) {
-                pixel_x = 0;
+        u8* line = &screen[current_line * PIXELS_W];
 
-                // Only use last 5 bits to stay in the range 0-31
-                tile_x = (tile_x + 1) & 31;
-                tile = gb->mmu.vram[tilemap_offset + tile_y * 32 + tile_x];
+        // The window covers the rest of the line from WX - 7 onwards, in
+        // which case the background is only drawn up to there
+        int window_start = PIXELS_W;
+        if (window_enabled && current_line >= window_y && window_x < PIXELS_W + 7)
+            window_start = std::max(window_x - 7, 0);
 
-                if (!background_tileset && tile < 128)
-                    tile += 256;
-            }
+        // The offset address in VRAM for either tilemap 1 or 0
+        int background_offset = (background_tilemap ? 0x1C00 : 0x1800);
+        draw_tilemap(line, 0, window_start, background_offset, scroll_x, current_line + scroll_y, shades);
+
+        if (window_start < PIXELS_W) {
+            // The window has its own line counter, which only advances on
+            // lines that show the window. With WX below 7 the window is
+            // shifted left.
+            int window_offset = (window_tilemap ? 0x1C00 : 0x1800);
+            draw_tilemap(line, window_start, PIXELS_W, window_offset, window_start - (window_x - 7), window_line, shades);
+            window_line++;
         }
     }
 
-    if (sprites_enabled) {
-        // For every sprite
-        for (std::size_t i = 0; i < sprites.size(); i++) {
-            Sprite s = sprites[i];
+    // Sprites are drawn on the line before the current one, which is then
+    // finished
+    if (sprites_enabled && current_line > 0) {
+        if (sprites_changed)
+            scan_sprites();
 
-            // If the sprite is at the height of the current scanline
-            if (s.y + 8 >= current_line && s.y < current_line) {
-                int tile_row = 0;
+        int line = current_line - 1;
 
-                // Account for the vertical flip
-                if (s.y_flip)
-                    tile_row = 7 - (current_line - s.y);
-                else
-                    tile_row = (current_line - s.y);
+        // For every sprite on the line
+        for (int i = 0; i < line_sprite_counts[line]; i++) {
+            Sprite s = sprites[line_sprites[line * MAX_LINE_SPRITES + i]];
 
-                tile_row -= 1;
+            int tile_row = 0;
 
-                int canvas_offset = (current_line - 1) * PIXELS_W + s.x;
-                u8 palette = s.palette ? sprite_palette_1 : sprite_palette_0;
+            // Account for the vertical flip
+            if (s.y_flip)
+                tile_row = 7 - (current_line - s.y);
+            else
+                tile_row = (current_line - s.y);
 
-                // For all pixels in the row
-                for (int x = 0; x < 8; x++) {
-                    int flipped_x = s.x_flip ? (7 - x) : x;
-                    int value = tileset[s.tile * 64 + tile_row * 8 + flipped_x];
+            tile_row -= 1;
 
-                    int index = (palette >> (value * 2)) & 0x3;
+            // Sprites starting past the right edge are not drawn
+            if (s.x >= PIXELS_W)
+                continue;
 
-                    // If the pixel is on the screen AND
-                    // it is not a transparant pixel AND
-                    // the sprite has priority OR the background is transparant
-                    if (s.x + x >= 0 && s.x + x < PIXELS_W && value != 0 &&
-                        (!s.priority || screen[canvas_offset] == color_palette[0]))
-                        screen[canvas_offset] = color_palette[index];
+            u8 palette = s.palette ? sprite_palette_1 : sprite_palette_0;
+            for (int value = 0; value < 4; value++)
+                shades[value] = (palette >> (value * 2)) & 0x3;
 
+            u8* out = &screen[line * PIXELS_W + s.x];
+            const u8* row = get_tile(s.tile) + tile_row * 8;
 
-                    canvas_offset++;
-                }
-            }
+            // Sprites crossing the right edge are clipped pixel by pixel
+            if (simd_compositor && s.x + 8 <= PIXELS_W)
+                draw_sprite_simd(out, row, s.x_flip, s.priority, shades);
+            else
+                draw_sprite_scalar(out, row, s.x_flip, s.priority, shades, std::min(8, PIXELS_W - s.x));
         }
     }
+
+    if (hash_frames)
+        hash_lines(current_line);
 }
 
 u8 GPU::get_lcd_byte() {
@@ -400,11 +633,73 @@ bool GPU::get_redraw() {
     return redraw;
 }
 
+// Adds the finished lines before end to the hash of the frame
+void GPU::hash_lines(int end) {
+    for (; hashed_lines < end; hashed_lines++)
+        line_hashes = hash_round(line_hashes, hash_line(&screen[hashed_lines * PIXELS_W]));
+}
+
+// Called at the start of the VBlank, the lines that weren't drawn are hashed
+// as they are
+void GPU::finish_frame_hash() {
+    hash_lines(PIXELS_H);
+    last_frame_hash = hash_avalanche(line_hashes);
+
+    hashed_lines = 0;
+    line_hashes = PRIME_5;
+}
+
+// Hash of the screen of the last frame that was drawn, if hash_frames is set.
+// It is updated when the VBlank starts.
+u64 GPU::frame_hash() {
+    return last_frame_hash;
+}
+
+// The screen in RGBA8888, converted on every call
 int* GPU::get_screen_buffer() {
-    return &screen[0];
+    convert_screen(PixelFormat::RGBA8888, &rgba_screen[0]);
+    return &rgba_screen[0];
+}
+
+// Writes the screen to out in the given format, PIXELS_W * PIXELS_H pixels
+// of 4, 2 or 1 bytes
+void GPU::convert_screen(PixelFormat::Type format, void* out) {
+    std::size_t pixels = screen.size();
+
+    switch (format) {
+    case PixelFormat::RGBA8888: {
+        int* rgba = (int*)out;
+        for (std::size_t i = 0; i < pixels; i++)
+            rgba[i] = color_palette[screen[i]];
+        break;
+    }
+    case PixelFormat::RGB565: {
+        u16 colors[4];
+        for (int shade = 0; shade < 4; shade++) {
+            unsigned int color = color_palette[shade];
+            colors[shade] = ((color >> 16) & 0xF800) | ((color >> 13) & 0x07E0) | ((color >> 11) & 0x001F);
+        }
+
+        u16* rgb = (u16*)out;
+        for (std::size_t i = 0; i < pixels; i++)
+            rgb[i] = colors[screen[i]];
+        break;
+    }
+    case PixelFormat::Grayscale: {
+        // The shades of the original screen, from white to black
+        const u8 GRAYS[4] = {0xFF, 0xAA, 0x55, 0x00};
+
+        u8* gray = (u8*)out;
+        for (std::size_t i = 0; i < pixels; i++)
+            gray[i] = GRAYS[screen[i]];
+        break;
+    }
+    }
 }
 
 void GPU::dump_vram() {
+    decode_tiles();
+
     for (int i = 0; i < (144 / 8) * (160 / 8); i++) {
         for (int x = 0; x < 8; x++) {
             for (int y = 0; y < 8; y++) {
@@ -412,7 +707,7 @@ void GPU::dump_vram() {
                 u8 mask = 0x3 << (value * 2);
                 int index = (background_palette & mask) >> (value * 2);
 
-                screen[(i*8%160) + x + (y + i*8/160*8)*160] = color_palette[index];
+                screen[(i*8%160) + x + (y + i*8/160*8)*160] = index;
             }
         }
     }
@@ -12,6 +12,14 @@ namespace GPUMode{
     enum Type {HBlank, VBlank, OAM, VRAM};
 }
 
+// Formats the screen can be converted to
+namespace PixelFormat {
+    enum Type {RGBA8888, RGB565, Grayscale};
+}
+
+// Sprites the hardware shows on a single line
+const int MAX_LINE_SPRITES = 10;
+
 struct Sprite {
     u8 y, x, tile;
     bool priority, y_flip, x_flip, palette;
@@ -25,15 +33,30 @@ public:
     void write_byte(u16 address, u8 value);
 
     void cycle();
+    int cycles_until_event();
     void reset();
-    void update_tile(u16 address, u8 value);
+    void update_tile(u16 address);
+    void decode_tile(int tile);
+    void decode_tiles();
+    // The 64 pixels of a tile, decoded first if its data was written to
+    const u8* get_tile(int tile) {
+        if (dirty_tiles[tile])
+            decode_tile(tile);
+        return &tileset[tile * 64];
+    }
     void update_object(u16 address, u8 value);
+    void scan_sprites();
+    void draw_tilemap(u8* line, int start, int end, int tilemap_offset, int map_x, int map_y, const u8* shades);
     void render_scanline();
 
     u8 get_lcd_byte();
     void set_lcd_byte(u8 lcd);
     bool get_redraw();
     int* get_screen_buffer();
+    void convert_screen(PixelFormat::Type format, void* out);
+    void hash_lines(int end);
+    void finish_frame_hash();
+    u64 frame_hash();
     void dump_vram();
 
 public:
@@ -55,6 +78,8 @@ public:
     // FF44 scanline byte
     u8 current_line;
     u8 ly_compare;
+    // FF4A & FF4B window position, the window starts at WX - 7
+    u8 window_y, window_x;
 
     // RGB color values for white, light gray, dark gray and black
     int color_palette[4];
@@ -71,10 +96,30 @@ public:
 
     GPUMode::Type mode;
     int cycles;
+    unsigned int updated_at; // CPU cycle the GPU was last updated
     bool redraw;
-    std::vector<int> screen;
-    std::vector<u8> tileset;
+    int window_line; // Line of the window drawn next
+    bool rendering; // Whether the current frame is drawn
+
+    // Hash the lines as they are finished, see frame_hash
+    bool hash_frames;
+    int hashed_lines;
+    u64 line_hashes; // Combined hash of the lines so far
+    u64 last_frame_hash;
+    // Compose scanlines with SSSE3 instead of pixel by pixel, if the build
+    // supports it
+    bool simd_compositor;
+    std::vector<u8> screen; // Shades 0-3, converted to colors when needed
+    std::vector<int> rgba_screen;
+    std::vector<u8> tileset; // Use get_tile, tiles are decoded lazily
+    std::vector<bool> dirty_tiles;
     std::vector<Sprite> sprites;
+
+    // Indices of the sprites on each line in the order they are drawn,
+    // found again when the position of a sprite changes
+    std::vector<u8> line_sprites;
+    std::vector<u8> line_sprite_counts;
+    bool sprites_changed;
 };
 
 #endif
\ No newline at end of file
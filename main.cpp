@@ -8,13 +8,16 @@
 #include "def.h"
 #include "debug.h"
 #include "gameboy.h"
+#include "pacer.h"
 
 
 const int SCREEN_W = PIXELS_W * 4;
 const int SCREEN_H = PIXELS_H * 4;
 
-const int FPS = 59.7;
-const float MS_PER_FRAME = 1000.0 / FPS;
+// Seconds of audio kept in the queue, more gives the emulation more room to
+// stutter without the sound cutting out but delays the sound
+const double AUDIO_MIN_LATENCY = 0.03;
+const double AUDIO_MAX_LATENCY = 0.1;
 
 int main(int argc, char* args[])
 {
@@ -26,6 +29,20 @@ int main(int argc, char* args[])
     //GameBoy gb("roms/Dr. Mario (World).gb");
     //GameBoy gb("C:/Users/Ruben/Documents/ROMs/GameBoy/cpu_instrs/cpu_instrs.gb");
 
+    // The cartridge already reported why it could not be read
+    if (!gb.cartridge.loaded)
+        return -1;
+
+    // Uncomment to run hot code through the x86-64 dynamic recompiler
+    //gb.cpu.dynarec.enabled = true;
+
+    // Uncomment to fast-forward through loops that wait for the GPU
+    //gb.cpu.skip_idle_loops = true;
+
+    // Cartridge clocks keep running while the emulator is closed, like on
+    // a real cartridge, instead of following the emulated time
+    gb.mapper.rtc.real_time = true;
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         std::cout << "Init error: " << SDL_GetError() << std::endl;
         return -1;
@@ -68,7 +85,20 @@ int main(int argc, char* args[])
 
     //SDL_RenderSetLogicalSize(renderer, SCREEN_W, SCREEN_H);
 
+    // The gameboy screen is uploaded into the same texture every frame, only
+    // when it changed. The hash of every frame tells whether it did.
+    SDL_Texture* texture = SDL_CreateTexture(
+        renderer,
+        SDL_PIXELFORMAT_RGBA8888,
+        SDL_TEXTUREACCESS_STREAMING,
+        PIXELS_W,
+        PIXELS_H);
+    gb.gpu.hash_frames = true;
+    bool uploaded = false;
+    u64 uploaded_hash = 0;
+
     Debug debug = Debug(&gb, renderer);
+    FramePacer pacer(AUDIO_MIN_LATENCY, AUDIO_MAX_LATENCY);
 
     bool quit = false;
     SDL_Event e;
@@ -76,6 +106,7 @@ int main(int argc, char* args[])
     bool redraw = false;
 
     bool stepping_mode = false;
+    unsigned int queued_samples = 0;
     u8 break_instr = 0;
     u16 break_PC = 0;
 
@@ -93,7 +124,7 @@ int main(int argc, char* args[])
                     break;
                 case SDL_SCANCODE_RIGHT:
                     gb.cpu.debug_print();
-                    gb.cycle();
+                    gb.step();
                     break;
                 default:
                     break;
@@ -117,38 +148,40 @@ int main(int argc, char* args[])
         /*
         The gameboy loop is structured as follows:
 
-        1.  Wait until any queued audio has finished playing
-        2.  While screen is not ready to redraw:
+        1.  While screen is not ready to redraw:
                 Cycle the gameboy
                 Push audio into the queue for playback if there is a new buffer
             
-        3.  Redraw the screen
-        4.  Wait any additional time to regulate to 60 FPS
+        2.  Redraw the screen
+        3.  Sleep until the next frame is due, keeping the audio queue
+            filled
         */
 
-        // Wait until the audio queue is finished playing
-        int queued = SDL_GetQueuedAudioSize(dev);
-        while (queued > 0) {
-            queued = SDL_GetQueuedAudioSize(dev);
-        }
-
         redraw = false;
-        bool sent_for_playback = false;
+
+        // With a breakpoint set every instruction has to be checked, so the
+        // gameboy is stepped instead of run until its next event. Translated
+        // code and skipped idle loops would also pass over instructions.
+        bool breakpoint = break_instr != 0 || break_PC != 0;
+        if (breakpoint) {
+            gb.cpu.dynarec.enabled = false;
+            gb.cpu.skip_idle_loops = false;
+        }
 
         // Cycle the gameboy until it wants us to redraw the screen
         while (!redraw && !stepping_mode) {
-            gb.cycle();
-
-            // The sample_queue_index can be 0 for multiple CPU cycles, so only
-            // send the audio for playback once
-            if (gb.apu.sample_queue_index == 0 && !sent_for_playback) {
-                SDL_QueueAudio(dev, &gb.apu.sample_queue[0], gb.apu.sample_queue.size()*4);
-                sent_for_playback = true;
+            if (breakpoint) {
+                gb.gpu.redraw = false;
+                gb.step();
+            } else {
+                gb.cycle();
             }
 
-            // Check if a new audio buffer has started to be filled
-            if (gb.apu.sample_queue_index == 1) {
-                sent_for_playback = false;
+            // The APU is updated right after it fills the sample queue, so
+            // send the audio for playback before it is overwritten
+            if (gb.apu.sample_queue_count != queued_samples) {
+                SDL_QueueAudio(dev, &gb.apu.sample_queue[0], gb.apu.sample_queue.size()*4);
+                queued_samples = gb.apu.sample_queue_count;
             }
 
             if (break_instr != 0 && gb.cpu.current_opcode() == break_instr)
@@ -162,42 +195,38 @@ int main(int argc, char* args[])
         // Clear the screen
         SDL_RenderClear(renderer);
 
-        // Create an SDL_Texture from the gameboy screen buffer
-        // This is not scaled up yet
-        SDL_Surface* screen = SDL_CreateRGBSurfaceFrom(
-            gb.gpu.get_screen_buffer(),
-            PIXELS_W,
-            PIXELS_H,
-            32,
-            PIXELS_W * 4,
-            0xFF000000,
-            0x00FF0000,
-            0x0000FF00,
-            0x000000FF);
-
-        SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, screen);
-        SDL_FreeSurface(screen);
+        // Upload the gameboy screen buffer if it changed, this is not scaled
+        // up yet. While stepping the frame is only partly drawn and its hash
+        // isn't known yet.
+        if (!uploaded || stepping_mode || gb.gpu.frame_hash() != uploaded_hash) {
+            SDL_UpdateTexture(texture, NULL, gb.gpu.get_screen_buffer(), PIXELS_W * 4);
+            uploaded = true;
+            uploaded_hash = gb.gpu.frame_hash();
+        }
 
         // Render the gameboy texture onto the screen
         SDL_Rect dst = {0, 0, SCREEN_W, SCREEN_H};
         SDL_RenderCopy(renderer, texture, NULL, &dst);
 
-        SDL_DestroyTexture(texture);
-
         // Debug info rendering
         debug.draw(SCREEN_W, 0);
 
         // Update the screen
         SDL_RenderPresent(renderer);
 
-        // Regulate to 60 fps
+        // Regulate to the 59.73 fps of the gameboy. The audio queue isn't
+        // filled while stepping, so only the clock is followed then.
+        double queued_audio = -1;
+        if (dev != 0 && !stepping_mode)
+            queued_audio = SDL_GetQueuedAudioSize(dev) / (double)(APU_SAMPLE_RATE * sizeof(float));
+        pacer.wait(queued_audio);
+
         int elapsed_time = SDL_GetTicks() - current_time;
-        if (elapsed_time < MS_PER_FRAME) {
+        if (elapsed_time > 0)
             debug.current_fps = 1000.0 / elapsed_time;
-            SDL_Delay(MS_PER_FRAME - elapsed_time);
-        }
     }
 
+    SDL_DestroyTexture(texture);
     SDL_CloseAudioDevice(dev);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
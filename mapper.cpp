@@ -0,0 +1,191 @@
+#include "mapper.h"
+
+#include "gameboy.h"
+
+// Battery backed RAM is saved this many cycles after the first write to it
+const unsigned int SAVE_DELAY = CLOCK_FREQ;
+
+Mapper::Mapper(GameBoy* gb) : gb(gb), rtc(gb) {
+    // Without a controller the RAM, if any, is always enabled
+    ram_enabled = gb->cartridge.mapper == MemoryMapper::None;
+    rom_bank_register = 1;
+    upper_bank_register = 0;
+    banking_mode = 0;
+    latch_register = 0xFF;
+
+    update_banks();
+
+    if (gb->cartridge.rtc) {
+        rtc.load(gb->cartridge.ram.data + gb->cartridge.ram_size);
+        gb->scheduler.schedule(Event::RTC, gb->cpu.cycles + CLOCK_SAVE_INTERVAL);
+    }
+}
+
+Mapper::~Mapper() {
+    // The save RAM is destroyed after the mapper and writes out the clock
+    if (gb->cartridge.rtc)
+        save_clock();
+}
+
+void Mapper::write_byte(u16 address, u8 value) {
+    switch (gb->cartridge.mapper) {
+    case MemoryMapper::MBC1:
+        if (address < 0x2000)
+            ram_enabled = (value & 0x0F) == 0x0A;
+        else if (address < 0x4000)
+            rom_bank_register = (value & 0x1F) ? (value & 0x1F) : 1;
+        else if (address < 0x6000)
+            upper_bank_register = value & 0x03;
+        else
+            banking_mode = value & 0x01;
+        break;
+    case MemoryMapper::MBC2:
+        // Bit 8 of the address selects the register
+        if (address < 0x4000) {
+            if (address & 0x100)
+                rom_bank_register = (value & 0x0F) ? (value & 0x0F) : 1;
+            else
+                ram_enabled = (value & 0x0F) == 0x0A;
+        }
+        break;
+    case MemoryMapper::MBC3:
+        if (address < 0x2000)
+            ram_enabled = (value & 0x0F) == 0x0A;
+        else if (address < 0x4000)
+            rom_bank_register = (value & 0x7F) ? (value & 0x7F) : 1;
+        else if (address < 0x6000)
+            upper_bank_register = value;
+        else {
+            if (gb->cartridge.rtc && latch_register == 0x00 && value == 0x01)
+                rtc.latch();
+            latch_register = value;
+            return;
+        }
+        break;
+    case MemoryMapper::MBC5:
+        if (address < 0x2000)
+            ram_enabled = (value & 0x0F) == 0x0A;
+        else if (address < 0x3000)
+            rom_bank_register = (rom_bank_register & 0x100) | value;
+        else if (address < 0x4000)
+            rom_bank_register = ((value & 0x01) << 8) | (rom_bank_register & 0xFF);
+        else if (address < 0x6000)
+            upper_bank_register = value & 0x0F;
+        break;
+    default:
+        // No bank registers, other controllers are not supported
+        return;
+    }
+
+    update_banks();
+}
+
+// Only called for the RAM pages the MMU has no direct pointer for
+u8 Mapper::read_ram(u16 address) {
+    if (ram == NULL) {
+        if (clock_selected())
+            return rtc.latched[upper_bank_register - 0x08];
+        return 0xFF;
+    }
+
+    return ram[address & ram_mask];
+}
+
+void Mapper::write_ram(u16 address, u8 value) {
+    if (ram == NULL) {
+        if (clock_selected()) {
+            rtc.write_register(upper_bank_register - 0x08, value);
+            save_clock();
+        }
+        return;
+    }
+
+    // MBC2 RAM only stores the lower 4 bits
+    if (gb->cartridge.mapper == MemoryMapper::MBC2)
+        value |= 0xF0;
+
+    u8* memory = ram + (address & ram_mask);
+    *memory = value;
+
+    mark_dirty(memory - gb->cartridge.ram.data);
+}
+
+// Whether A000-BFFF shows the clock registers instead of RAM
+bool Mapper::clock_selected() {
+    return gb->cartridge.rtc && ram_enabled &&
+           upper_bank_register >= 0x08 && upper_bank_register <= 0x0C;
+}
+
+// Writes the clock state after the RAM in the save file
+void Mapper::save_clock() {
+    Cartridge& cartridge = gb->cartridge;
+
+    rtc.store(cartridge.ram.data + cartridge.ram_size);
+    mark_dirty(cartridge.ram_size);
+}
+
+// The first write to a page of battery backed RAM marks it to be saved,
+// after that it is written directly until it is saved
+void Mapper::mark_dirty(std::size_t offset) {
+    SaveRam& save = gb->cartridge.ram;
+    if (!save.tracks_writes(offset))
+        return;
+
+    if (!save.has_dirty_pages())
+        gb->scheduler.schedule(Event::SaveRam, gb->cpu.cycles + SAVE_DELAY);
+    save.mark_dirty(offset);
+    gb->mmu.map_cartridge();
+}
+
+// Recomputes the visible banks from the registers and remaps the MMU pages
+void Mapper::update_banks() {
+    Cartridge& cartridge = gb->cartridge;
+
+    int ram_bank = 0;
+    rom_lower_bank = 0;
+    rom_upper_bank = rom_bank_register;
+
+    switch (cartridge.mapper) {
+    case MemoryMapper::None:
+        rom_upper_bank = 1;
+        break;
+    case MemoryMapper::MBC1:
+        rom_upper_bank |= upper_bank_register << 5;
+        if (banking_mode == 1) {
+            rom_lower_bank = upper_bank_register << 5;
+            ram_bank = upper_bank_register;
+        }
+        break;
+    case MemoryMapper::MBC3:
+        // 08-0C select the clock registers instead of RAM
+        ram_bank = upper_bank_register < 0x08 ? (upper_bank_register & 0x03) : -1;
+        break;
+    case MemoryMapper::MBC5:
+        ram_bank = upper_bank_register;
+        break;
+    default:
+        break;
+    }
+
+    // Bank numbers wrap around at the size of the ROM
+    rom_lower_bank %= cartridge.rom_banks;
+    rom_upper_bank %= cartridge.rom_banks;
+    rom_lower = cartridge.rom + rom_lower_bank * ROM_BANK_SIZE;
+    rom_upper = cartridge.rom + rom_upper_bank * ROM_BANK_SIZE;
+
+    unsigned int ram_size = cartridge.ram_size;
+    ram = NULL;
+    ram_mask = 0;
+    ram_direct_writes = cartridge.mapper != MemoryMapper::MBC2;
+    if (ram_enabled && ram_size > 0 && ram_bank >= 0) {
+        if (ram_size < ERAM_SIZE) {
+            ram = cartridge.ram.data;
+            ram_mask = ram_size - 1;
+        } else {
+            ram = cartridge.ram.data + (ram_bank * ERAM_SIZE) % ram_size;
+            ram_mask = ERAM_SIZE - 1;
+        }
+    }
+
+    gb->mmu.map_cartridge();
+}
@@ -0,0 +1,72 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include <cstddef>
+
+#include "def.h"
+#include "rtc.h"
+
+class GameBoy;
+
+// The running clock is saved this often, well before the cycle counter it
+// is measured with wraps around
+const unsigned int CLOCK_SAVE_INTERVAL = 60 * CLOCK_FREQ;
+
+/*
+    Memory bank controller of the cartridge
+
+    Writes to 0000-7FFF set the bank registers, after which the mapper
+    works out which parts of the ROM and RAM are visible and has the MMU
+    point its page table at them. Reads never go through here, only RAM
+    accesses the page table can't serve directly do.
+
+    None    32 KiB ROM, optionally 8 KiB RAM
+    MBC1    2 MiB ROM and 32 KiB RAM, a 5 bit and a 2 bit bank register,
+            the banking mode selects whether the 2 bit one also switches
+            0000-3FFF and the RAM bank
+    MBC2    256 KiB ROM, 512 4-bit values of built-in RAM
+    MBC3    2 MiB ROM, 32 KiB RAM and a real time clock, see rtc.h
+    MBC5    8 MiB ROM, 128 KiB RAM, a 9 bit ROM bank number where bank 0
+            can be selected too
+*/
+class Mapper {
+public:
+    Mapper(GameBoy* gb);
+    ~Mapper();
+
+    void write_byte(u16 address, u8 value);
+
+    u8 read_ram(u16 address);
+    void write_ram(u16 address, u8 value);
+
+    void update_banks();
+
+    bool clock_selected();
+    void save_clock();
+    void mark_dirty(std::size_t offset);
+
+public:
+    GameBoy* gb;
+
+    // Bank registers, not all are used by every mapper
+    bool ram_enabled;
+    int rom_bank_register;
+    int upper_bank_register; // MBC1 upper ROM bits or RAM bank, MBC3/5 RAM bank
+    int banking_mode;
+    int latch_register; // MBC3, writing 00 and then 01 latches the clock
+
+    // Banks visible at 0000-3FFF and 4000-7FFF, and their memory
+    int rom_lower_bank, rom_upper_bank;
+    u8* rom_lower;
+    u8* rom_upper;
+
+    // Memory visible at A000-BFFF, NULL if there is none or it is disabled,
+    // ram_mask mirrors RAM smaller than 8 KiB
+    u8* ram;
+    unsigned int ram_mask;
+    bool ram_direct_writes;
+
+    RTC rtc;
+};
+
+#endif
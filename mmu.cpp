@@ -25,20 +25,37 @@ const u8 bios[0x100] = {
 };
 
 MMU::MMU(GameBoy* gb) : gb(gb) {
-    current_rom_bank = 0x01;
+    write_count = 0;
+    volatile_read = false;
     
     vram.resize(VRAM_SIZE);
-    eram.resize(ERAM_SIZE);
     wram.resize(WRAM_SIZE);
     oam.resize(OAM_SIZE);
     hram.resize(HRAM_SIZE);
+
+    for (int page = 0; page < 0x100; page++) {
+        read_pages[page] = NULL;
+        write_pages[page] = NULL;
+    }
+
+    // The cartridge pages are mapped by the mapper once it is constructed
+    for (int page = 0x80; page < 0xA0; page++)
+        read_pages[page] = &vram[(page & 0x1F) << 8];
+    // Writes to the tile data are decoded by the GPU, the tilemaps are not
+    for (int page = 0x98; page < 0xA0; page++)
+        write_pages[page] = &vram[(page & 0x1F) << 8];
+
+    // WRAM and its echo
+    for (int page = 0xC0; page < 0xFE; page++)
+        read_pages[page] = &wram[(page & 0x1F) << 8];
+    map_wram_writes();
 }
 
 MMU::~MMU() {
 
 }
 
-u8 MMU::read_byte(u16 address) {
+u8 MMU::read_handler(u16 address) {
     u8 result = 0;
 
     if (address < 0x4000) {
@@ -46,18 +63,18 @@ u8 MMU::read_byte(u16 address) {
             if (address < 0x100)
                 result = bios[address];
             else
-                result = gb->cartridge.rom[address];
+                result = gb->mapper.rom_lower[address];
         } else
-            result = gb->cartridge.rom[address];
+            result = gb->mapper.rom_lower[address];
 
         // Uncomment to skip the bios
         //result = rom_0[address];
     } else if (address < 0x8000)
-        result = gb->cartridge.rom[(address & 0x3FFF) + current_rom_bank * 0x4000];
+        result = gb->mapper.rom_upper[address & 0x3FFF];
     else if (address < 0xA000)
         result = vram[address & 0x1FFF];
     else if (address < 0xC000)
-        result = eram[address & 0x1FFF];
+        result = gb->mapper.read_ram(address);
     //else if (address < 0xE000)
     //    return wram[address & 0x1FFF];
     else if (address < 0xFE00)
@@ -66,8 +83,11 @@ u8 MMU::read_byte(u16 address) {
         if (address < 0xFEA0)
             result = oam[address & 0xFF];
     } else if (address < 0xFF10) {
+        if (address != 0xFF0F)
+            volatile_read = true;
         result = gb->read_byte(address);
     } else if (address < 0xFF40) {
+        volatile_read = true;
         result = gb->apu.read_byte(address);
     } else if (address < 0xFF4C) {
         result = gb->gpu.read_byte(address);
@@ -79,32 +99,23 @@ u8 MMU::read_byte(u16 address) {
     return result;
 }
 
-void MMU::write_byte(u16 address, u8 value) {
-    if (address < 0x2000) {
-        //std::cout << fmt::format("RAM Enable write @ {0:04X}: {1:04X}", address, value) << std::endl;
-    } else if (address < 0x4000) {
-        //std::cout << fmt::format("ROM Bank Number write @ {0:04X}: {1:04X}", address, value) << std::endl;
-        // Lower 5 bits of ROM bank number
-        current_rom_bank = value & 0b00011111;
-        
-        //rom_0[address] = value;
-    } else if (address < 0x6000) {
-        // Upper 2 bits of ROM bank number
-        current_rom_bank = (value << 5) | current_rom_bank;
-    } else if (address < 0x8000) {
-        // Banking mode select
-        //std::cout << fmt::format("Banking mode select write @ {0:04X}: {1:04X}", address, value) << std::endl;
+void MMU::write_handler(u16 address, u8 value) {
+    if (address < 0x8000) {
+        // Bank registers of the memory bank controller
+        gb->mapper.write_byte(address, value);
+        gb->cpu.block_cache.reset_cursor();
     } else if (address < 0xA000) {
         vram[address & 0x1FFF] = value;
         if (address < 0x9800) {
-            gb->gpu.update_tile(address, value);
+            gb->gpu.update_tile(address);
         }
     } else if (address < 0xC000) {
-        eram[address & 0x1FFF] = value;
+        gb->mapper.write_ram(address, value);
     //else if (address < 0xE000)
     //    wram[address & 0x1FFF] = value;
     } else if (address < 0xFE00) {
         wram[address & 0x1FFF] = value;
+        gb->cpu.block_cache.ram_written(address);
     } else if (address < 0xFF00) {
         // Graphics sprite information
         if (address < 0xFEA0) {
@@ -121,16 +132,78 @@ void MMU::write_byte(u16 address, u8 value) {
         gb->disable_bios = 0x1;
     } else if (address < 0xFFFF) {
         hram[address & 0x7F] = value;
+        gb->cpu.block_cache.ram_written(address);
         //std::cout << std::hex << "Writing HRAM[" << address << "]= " << (int)value << std::endl;
     } else if (address == 0xFFFF)
         gb->interrupt_enable = value;
 }
 
-u16 MMU::read_word(u16 address) {
+// Points the cartridge pages at the banks selected by the mapper
+void MMU::map_cartridge() {
+    Mapper& mapper = gb->mapper;
+
+    // Page 0 stays with the handler, the bios is mapped over it until
+    // disable_bios is set
+    for (int page = 0x01; page < 0x40; page++)
+        read_pages[page] = mapper.rom_lower + (page << 8);
+    for (int page = 0x40; page < 0x80; page++)
+        read_pages[page] = mapper.rom_upper + ((page & 0x3F) << 8);
+
+    // Writes to battery backed RAM go through the mapper until the page is
+    // marked to be saved
+    SaveRam& save = gb->cartridge.ram;
+    for (int page = 0xA0; page < 0xC0; page++) {
+        u8* memory = NULL;
+        bool direct = false;
+        if (mapper.ram != NULL) {
+            memory = mapper.ram + (((page & 0x1F) << 8) & mapper.ram_mask);
+            direct = mapper.ram_direct_writes && !save.tracks_writes(memory - save.data);
+        }
+
+        read_pages[page] = memory;
+        write_pages[page] = direct ? memory : NULL;
+    }
+}
+
+// Writes every WRAM page directly again, once the block cache holds no code
+// in WRAM anymore
+void MMU::map_wram_writes() {
+    for (int page = 0xC0; page < 0xFE; page++)
+        write_pages[page] = &wram[(page & 0x1F) << 8];
+}
+
+// Sends writes to the WRAM page of address, and its echo, to the handler
+void MMU::trap_wram_writes(u16 address) {
+    int page = (address >> 8) & 0x1F;
+
+    write_pages[0xC0 + page] = NULL;
+    if (0xE0 + page < 0xFE)
+        write_pages[0xE0 + page] = NULL;
+}
+
+// The stack usually lives in HRAM, so words there are accessed at once
+// instead of dispatching both bytes through the FF page handler
+static bool in_hram(u16 address) {
+    return address >= 0xFF80 && address < 0xFFFE;
+}
+
+u16 MMU::read_word_handler(u16 address) {
+    if (in_hram(address))
+        return hram[address & 0x7F] | (hram[(address & 0x7F) + 1] << 8);
+
     return (read_byte(address + 1) << 8) | read_byte(address);
 }
 
-void MMU::write_word(u16 address, u16 value) {
+void MMU::write_word_handler(u16 address, u16 value) {
+    if (in_hram(address)) {
+        write_count += 2;
+        hram[address & 0x7F] = value & 0x00FF;
+        hram[(address & 0x7F) + 1] = value >> 8;
+        gb->cpu.block_cache.ram_written(address);
+        gb->cpu.block_cache.ram_written(address + 1);
+        return;
+    }
+
     write_byte(address, value & 0x00FF);
     write_byte(address + 1, value >> 8);
 }
\ No newline at end of file
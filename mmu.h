@@ -33,6 +33,8 @@ class GameBoy;
     9800-9BFF   Tilemap #0: 32x32=1024 tiles (bytes)
     9C00-9FFF   Tilemap #1: 32x32=1024 tiles (bytes)
 
+    A000-BFFF   Cartridge RAM, see mapper.h
+
     C000-CFFF   Internal RAM bank 0 (fixed)
     D000-DFFF   Switchable RAM banks
 
@@ -49,18 +51,74 @@ public:
     MMU(GameBoy* gb);
     ~MMU();
 
-    u8 read_byte(u16 address);
-    void write_byte(u16 address, u8 value);
-
-    u16 read_word(u16 address);
-    void write_word(u16 address, u16 value);
+    // Plain memory is accessed directly through the page tables, only the
+    // pages without one go through the handlers
+    u8 read_byte(u16 address) {
+        const u8* page = read_pages[address >> 8];
+        if (page != NULL)
+            return page[address & 0xFF];
+
+        return read_handler(address);
+    }
+
+    void write_byte(u16 address, u8 value) {
+        write_count++;
+
+        u8* page = write_pages[address >> 8];
+        if (page != NULL)
+            page[address & 0xFF] = value;
+        else
+            write_handler(address, value);
+    }
+
+    // Both bytes of a word are in the same page unless it starts at the
+    // last byte of one
+    u16 read_word(u16 address) {
+        const u8* page = read_pages[address >> 8];
+        if (page != NULL && (address & 0xFF) != 0xFF)
+            return page[address & 0xFF] | (page[(address & 0xFF) + 1] << 8);
+
+        return read_word_handler(address);
+    }
+
+    void write_word(u16 address, u16 value) {
+        u8* page = write_pages[address >> 8];
+        if (page != NULL && (address & 0xFF) != 0xFF) {
+            write_count += 2;
+            page[address & 0xFF] = value & 0x00FF;
+            page[(address & 0xFF) + 1] = value >> 8;
+        } else
+            write_word_handler(address, value);
+    }
+
+    u8 read_handler(u16 address);
+    void write_handler(u16 address, u8 value);
+    u16 read_word_handler(u16 address);
+    void write_word_handler(u16 address, u16 value);
+
+    void map_cartridge();
+    void map_wram_writes();
+    void trap_wram_writes(u16 address);
 
 public:
     GameBoy* gb;
 
-    u8 current_rom_bank;
-
-    std::vector<u8> vram, eram, wram, oam, hram;
+    std::vector<u8> vram, wram, oam, hram;
+
+    // Host memory of every 256 byte page, or NULL if accesses to the page
+    // need a handler: the bios overlay, the bank registers, cartridge RAM
+    // that is disabled or needs its writes masked, tile data writes, OAM,
+    // the hardware registers and HRAM (which shares its page with them).
+    // WRAM pages holding cached code also trap writes, so the block cache
+    // sees them.
+    u8* read_pages[0x100];
+    u8* write_pages[0x100];
+
+    // Used by the idle loop detection in the CPU: the number of writes, and
+    // whether a register was read that can change without a GPU or timer
+    // event (everything except IF and the GPU registers)
+    unsigned int write_count;
+    bool volatile_read;
 };
 
 #endif
\ No newline at end of file
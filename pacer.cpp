@@ -0,0 +1,41 @@
+#include "pacer.h"
+
+#include <thread>
+
+// Falling further behind than this many frames restarts the pacing from
+// now, instead of running the missed frames as fast as possible
+const int MAX_FRAMES_BEHIND = 4;
+
+FramePacer::FramePacer(double min_latency, double max_latency) :
+    min_latency(min_latency), max_latency(max_latency) {
+    std::chrono::duration<double> seconds((double)T_FULL_FRAME / CLOCK_FREQ);
+    frame_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(seconds);
+
+    next_frame = std::chrono::steady_clock::now();
+}
+
+// Blocks until the next frame is due. queued_audio is the length of the
+// audio queue in seconds, or negative to only follow the clock.
+void FramePacer::wait(double queued_audio) {
+    auto now = std::chrono::steady_clock::now();
+    next_frame += frame_time;
+
+    if (queued_audio >= 0 && queued_audio < min_latency) {
+        // Refill the audio queue without waiting
+        next_frame = now;
+        return;
+    }
+
+    if (queued_audio > max_latency) {
+        // Give the audio queue time to drain below the window
+        std::chrono::duration<double> excess(queued_audio - max_latency);
+        next_frame += std::chrono::duration_cast<std::chrono::steady_clock::duration>(excess);
+    }
+
+    if (now - next_frame > MAX_FRAMES_BEHIND * frame_time) {
+        next_frame = now;
+        return;
+    }
+
+    std::this_thread::sleep_until(next_frame);
+}
@@ -0,0 +1,31 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <chrono>
+
+#include "def.h"
+
+/*
+    Paces the frontend to the refresh rate of the gameboy, 59.7275 frames
+    per second, by sleeping until the next frame is due.
+
+    The audio queue is kept between min_latency and max_latency seconds of
+    samples: frames are started early while it is too short and later while
+    it is too long, so the audio neither runs dry nor lags behind.
+*/
+class FramePacer {
+public:
+    FramePacer(double min_latency, double max_latency);
+
+    void wait(double queued_audio = -1);
+
+public:
+    // Audio latency window, in seconds of queued samples
+    double min_latency;
+    double max_latency;
+
+    std::chrono::steady_clock::duration frame_time;
+    std::chrono::steady_clock::time_point next_frame;
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include "rtc.h"
+
+#include <ctime>
+
+#include "gameboy.h"
+
+// Valid bits of each register
+const u8 REGISTER_MASKS[RTCRegister::Count] = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+
+RTC::RTC(GameBoy* gb) : gb(gb) {
+    real_time = false;
+
+    for (int i = 0; i < RTCRegister::Count; i++) {
+        registers[i] = 0;
+        latched[i] = 0;
+    }
+
+    updated_at = gb->cpu.cycles;
+    updated_time = time(NULL);
+}
+
+RTC::~RTC() {
+
+}
+
+void RTC::update() {
+    u64 seconds;
+    u64 now = time(NULL);
+
+    // Keep the time of the mode that isn't used current as well, so it can
+    // be switched at any moment
+    if (real_time) {
+        seconds = now > updated_time ? now - updated_time : 0;
+        updated_at = gb->cpu.cycles;
+        updated_time += seconds;
+    } else {
+        seconds = (gb->cpu.cycles - updated_at) / CLOCK_FREQ;
+        updated_at += seconds * CLOCK_FREQ;
+        updated_time = now;
+    }
+
+    if (!(registers[RTCRegister::DaysHigh] & 0x40))
+        add_seconds(seconds);
+}
+
+void RTC::add_seconds(u64 seconds) {
+    if (seconds == 0)
+        return;
+
+    u8* r = registers;
+    u64 days = r[RTCRegister::DaysLow] | ((r[RTCRegister::DaysHigh] & 0x01) << 8);
+    u64 total = r[RTCRegister::Seconds] + 60 * (r[RTCRegister::Minutes] + 60 * (r[RTCRegister::Hours] + 24 * days)) + seconds;
+
+    r[RTCRegister::Seconds] = total % 60;
+    total /= 60;
+    r[RTCRegister::Minutes] = total % 60;
+    total /= 60;
+    r[RTCRegister::Hours] = total % 24;
+    days = total / 24;
+
+    // The carry bit stays set until the game clears it
+    if (days > 0x1FF)
+        r[RTCRegister::DaysHigh] |= 0x80;
+    days &= 0x1FF;
+    r[RTCRegister::DaysLow] = days & 0xFF;
+    r[RTCRegister::DaysHigh] = (r[RTCRegister::DaysHigh] & 0xFE) | (days >> 8);
+}
+
+// Copies the current time into the registers the game can read
+void RTC::latch() {
+    update();
+
+    for (int i = 0; i < RTCRegister::Count; i++)
+        latched[i] = registers[i];
+}
+
+void RTC::write_register(int reg, u8 value) {
+    update();
+
+    registers[reg] = value & REGISTER_MASKS[reg];
+    latched[reg] = registers[reg];
+
+    // Writing the seconds restarts the current second
+    if (reg == RTCRegister::Seconds)
+        updated_at = gb->cpu.cycles;
+}
+
+static u64 read_le(const u8* data, int bytes) {
+    u64 value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | data[i];
+
+    return value;
+}
+
+static void write_le(u8* data, int bytes, u64 value) {
+    for (int i = 0; i < bytes; i++)
+        data[i] = (value >> (i * 8)) & 0xFF;
+}
+
+void RTC::load(const u8* data) {
+    for (int i = 0; i < RTCRegister::Count; i++) {
+        registers[i] = read_le(data + i * 4, 4) & REGISTER_MASKS[i];
+        latched[i] = read_le(data + 20 + i * 4, 4) & REGISTER_MASKS[i];
+    }
+
+    // In real time mode the clock catches up with the time the emulator
+    // wasn't running on the next update, a new save file has no timestamp
+    u64 saved_time = read_le(data + 40, 8);
+    if (saved_time != 0)
+        updated_time = saved_time;
+    updated_at = gb->cpu.cycles;
+}
+
+void RTC::store(u8* data) {
+    update();
+
+    for (int i = 0; i < RTCRegister::Count; i++) {
+        write_le(data + i * 4, 4, registers[i]);
+        write_le(data + 20 + i * 4, 4, latched[i]);
+    }
+    write_le(data + 40, 8, updated_time);
+}
@@ -0,0 +1,53 @@
+#ifndef RTC_H
+#define RTC_H
+
+#include "def.h"
+
+class GameBoy;
+
+// Size of the clock state at the end of the save file, in the layout most
+// emulators use: the five registers, the five latched registers (each as a
+// 32-bit value) and a 64-bit UNIX timestamp
+const int RTC_SAVE_SIZE = 48;
+
+namespace RTCRegister {
+    enum Type {Seconds, Minutes, Hours, DaysLow, DaysHigh, Count};
+}
+
+/*
+    Real time clock of MBC3 cartridges
+
+    The clock isn't ticked, it is brought up to date from the cycles (or
+    in real time mode the host time) passed since its last update whenever
+    it is latched, written or saved.
+
+    DH: bit 0 is bit 8 of the day counter, bit 6 halts the clock and bit 7
+    is set when the day counter overflows
+*/
+class RTC {
+public:
+    RTC(GameBoy* gb);
+    ~RTC();
+
+    void update();
+    void add_seconds(u64 seconds);
+    void latch();
+
+    void write_register(int reg, u8 value);
+
+    void load(const u8* data);
+    void store(u8* data);
+
+public:
+    GameBoy* gb;
+
+    bool real_time; // Follow the host clock instead of the emulated cycles
+
+    u8 registers[RTCRegister::Count];
+    u8 latched[RTCRegister::Count]; // What the game reads
+
+    unsigned int updated_at; // CPU cycle the clock was last updated
+    u64 updated_time; // Host time of the last update, in seconds
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "saveram.h"
+
+#include <algorithm>
+#include <iostream>
+#include "fmt/format.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SaveRam::SaveRam() {
+    data = NULL;
+    size = 0;
+    persistent = false;
+    mapping = NULL;
+    file = -1;
+    dirty_pages = 0;
+    stopping = false;
+}
+
+SaveRam::~SaveRam() {
+    if (flush_thread.joinable()) {
+        // Write out everything that is left before stopping
+        commit();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        pages_pending.notify_one();
+        flush_thread.join();
+    }
+
+#if !defined(_WIN32)
+    if (mapping != NULL)
+        munmap(mapping, size);
+    // Releases the lock on the file
+    if (file >= 0)
+        close(file);
+#endif
+}
+
+void SaveRam::allocate(std::size_t size) {
+    memory.assign(size, 0);
+    data = memory.data();
+    this->size = size;
+}
+
+void SaveRam::open(const std::string& filename, std::size_t size) {
+#if !defined(_WIN32)
+    file = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (file >= 0) {
+        // Another instance already saves to this file
+        bool shared = flock(file, LOCK_EX | LOCK_NB) != 0;
+
+        // New save files are filled with zeros. The whole save has to be in
+        // the file, accessing the mapping past its end would crash.
+        struct stat info;
+        bool sized = fstat(file, &info) == 0 && (std::size_t)info.st_size >= size;
+        if (!sized && !shared)
+            sized = ftruncate(file, size) == 0;
+
+        void* mapped = MAP_FAILED;
+        if (sized)
+            mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, shared ? MAP_PRIVATE : MAP_SHARED, file, 0);
+        if (mapped != MAP_FAILED) {
+            mapping = mapped;
+            data = (u8*)mapped;
+            this->size = size;
+            persistent = !shared;
+        }
+    }
+
+    if (persistent) {
+        dirty.assign((size + SAVE_PAGE_SIZE - 1) / SAVE_PAGE_SIZE, false);
+        flush_thread = std::thread(&SaveRam::flush_pages, this);
+        return;
+    }
+    if (mapping != NULL) {
+        std::cout << fmt::format("Save file in use, not saving: {0}", filename) << std::endl;
+        return;
+    }
+#endif
+
+    std::cout << fmt::format("Cannot open the save file: {0}", filename) << std::endl;
+    allocate(size);
+}
+
+void SaveRam::mark_dirty(std::size_t offset) {
+    if (!dirty[offset / SAVE_PAGE_SIZE]) {
+        dirty[offset / SAVE_PAGE_SIZE] = true;
+        dirty_pages++;
+    }
+}
+
+// Hands the dirty pages to the flush thread, writes to them are tracked
+// again afterwards
+void SaveRam::commit() {
+    if (dirty_pages == 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::size_t page = 0; page < dirty.size(); page++) {
+            if (dirty[page]) {
+                pending.push_back(page * SAVE_PAGE_SIZE);
+                dirty[page] = false;
+            }
+        }
+    }
+    dirty_pages = 0;
+
+    pages_pending.notify_one();
+}
+
+void SaveRam::flush_pages() {
+#if !defined(_WIN32)
+    // msync needs addresses aligned to the pages of the host
+    std::size_t host_page = sysconf(_SC_PAGESIZE);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        pages_pending.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty())
+            return;
+
+        std::vector<std::size_t> pages;
+        pages.swap(pending);
+        lock.unlock();
+
+        std::sort(pages.begin(), pages.end());
+
+        // Each host page only needs to be flushed once
+        std::size_t flushed = size;
+        for (std::size_t offset : pages) {
+            std::size_t start = offset - offset % host_page;
+            if (start == flushed)
+                continue;
+
+            msync(data + start, std::min(host_page, size - start), MS_SYNC);
+            flushed = start;
+        }
+
+        lock.lock();
+    }
+#endif
+}
@@ -0,0 +1,68 @@
+#ifndef SAVERAM_H
+#define SAVERAM_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "def.h"
+
+// Writes are tracked per page of the MMU page table
+const std::size_t SAVE_PAGE_SIZE = 0x100;
+
+/*
+    Cartridge RAM, backed by the save file if the cartridge has a battery
+
+    The save file is mapped into memory, so the RAM is the contents of the
+    file. Pages written to are marked dirty, and commit() hands them to a
+    background thread which writes them to disk with msync, so saving never
+    blocks the emulation.
+
+    Only one SaveRam can persist a file at a time, others opening the same
+    file get a private copy of its contents.
+*/
+class SaveRam {
+public:
+    SaveRam();
+    ~SaveRam();
+
+    void allocate(std::size_t size);
+    void open(const std::string& filename, std::size_t size);
+
+    // Whether writes to the page at offset have to be reported through
+    // mark_dirty, they can't go to the memory directly
+    bool tracks_writes(std::size_t offset) {
+        return persistent && !dirty[offset / SAVE_PAGE_SIZE];
+    }
+
+    void mark_dirty(std::size_t offset);
+    bool has_dirty_pages() { return dirty_pages > 0; }
+    void commit();
+
+public:
+    u8* data;
+    std::size_t size;
+    bool persistent; // Whether the memory is written to the save file
+
+private:
+    void flush_pages();
+
+    std::vector<u8> memory; // Used if there is no save file
+    void* mapping;
+    int file; // Kept open to hold the lock on it
+
+    std::vector<bool> dirty;
+    int dirty_pages;
+
+    // Shared with the flush thread
+    std::thread flush_thread;
+    std::mutex mutex;
+    std::condition_variable pages_pending;
+    std::vector<std::size_t> pending; // Offsets of pages to flush
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include "scheduler.h"
+
+#include <climits>
+
+Scheduler::Scheduler() {
+    for (int i = 0; i < Event::Count; i++) {
+        deadlines[i] = 0;
+        scheduled[i] = false;
+    }
+
+    has_next = false;
+    next_time = 0;
+    next_event = Event::Timer;
+}
+
+// Sets the deadline of an event, replacing the previous one
+void Scheduler::schedule(Event::Type event, unsigned int time) {
+    deadlines[event] = time;
+    scheduled[event] = true;
+
+    find_next();
+}
+
+void Scheduler::cancel(Event::Type event) {
+    scheduled[event] = false;
+
+    find_next();
+}
+
+// Removes the earliest event if it is due at the given time
+bool Scheduler::pop(unsigned int time, Event::Type& event) {
+    if (!is_due(time))
+        return false;
+
+    event = next_event;
+    scheduled[event] = false;
+    find_next();
+
+    return true;
+}
+
+// The number of cycles from the given time until the earliest event, this is
+// 0 or negative if it is already due
+int Scheduler::cycles_until_next(unsigned int time) {
+    if (!has_next)
+        return INT_MAX;
+
+    return (int)(next_time - time);
+}
+
+void Scheduler::find_next() {
+    has_next = false;
+
+    // On equal deadlines the event that comes first in Event::Type wins
+    for (int i = 0; i < Event::Count; i++) {
+        if (!scheduled[i])
+            continue;
+
+        if (!has_next || (int)(deadlines[i] - next_time) < 0) {
+            has_next = true;
+            next_time = deadlines[i];
+            next_event = (Event::Type)i;
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "def.h"
+
+namespace Event {
+    enum Type {Timer, GPU, APU, SaveRam, RTC, Count};
+}
+
+/*
+Keeps track of the CPU cycle at which each component next needs to be
+updated, the CPU can run without interruption until the earliest of them.
+
+Times are absolute values of CPU::cycles and are compared through their
+difference, so they keep working when the cycle counter wraps around.
+There are only a few kinds of events, so instead of a heap the deadlines
+are stored per event with the earliest one cached.
+*/
+class Scheduler {
+public:
+    Scheduler();
+
+    void schedule(Event::Type event, unsigned int time);
+    void cancel(Event::Type event);
+    bool pop(unsigned int time, Event::Type& event);
+    int cycles_until_next(unsigned int time);
+
+    // Whether the earliest event is due at the given time
+    bool is_due(unsigned int time) const {
+        return has_next && (int)(time - next_time) >= 0;
+    }
+
+private:
+    void find_next();
+
+public:
+    unsigned int deadlines[Event::Count];
+    bool scheduled[Event::Count];
+
+    bool has_next;
+    unsigned int next_time;
+    Event::Type next_event;
+};
+
+#endif